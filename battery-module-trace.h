@@ -0,0 +1,121 @@
+/**
+ * Tracepoints of the battery driver for the Acer Switch 11 laptop.
+ *
+ * They allow to relate the queries of userspace pollers to the resulting bus
+ * activity (e.g. using perf, ftrace or bpftrace). Disabled tracepoints have no
+ * measurable cost.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM acer_switch_battery
+
+#if !defined(BATTERY_MODULE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define BATTERY_MODULE_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/power_supply.h>
+
+/**
+ * A transfer reading a battery register (or a block of registers).
+ *
+ * The read bytes are only recorded, if the transfer succeeded.
+ */
+TRACE_EVENT(battery_register_read,
+    TP_PROTO(
+        u8 reg,
+        const u8 *data,
+        u16 len,
+        int result,
+        int tries,
+        s64 duration_ns
+    ),
+    TP_ARGS(reg, data, len, result, tries, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(u8, reg)
+        __field(u16, len)
+        __field(int, result)
+        __field(int, tries)
+        __field(s64, duration_ns)
+        __dynamic_array(u8, data, result ? 0 : len)
+    ),
+
+    TP_fast_assign(
+        __entry->reg = reg;
+        __entry->len = result ? 0 : len;
+        __entry->result = result;
+        __entry->tries = tries;
+        __entry->duration_ns = duration_ns;
+        memcpy(__get_dynamic_array(data), data, __entry->len);
+    ),
+
+    TP_printk("reg=0x%02X value=%s result=%d tries=%d duration=%lldns",
+        __entry->reg,
+        __print_hex(__get_dynamic_array(data), __entry->len),
+        __entry->result,
+        __entry->tries,
+        __entry->duration_ns
+    )
+);
+
+/**
+ * A query of a battery property.
+ *
+ * `cached` is set, if the property was answered without triggering a refresh
+ * of the snapshot (i.e. constant properties or a fresh snapshot).
+ */
+TRACE_EVENT(battery_get_property,
+    TP_PROTO(enum power_supply_property property, int result, bool cached),
+    TP_ARGS(property, result, cached),
+
+    TP_STRUCT__entry(
+        __field(int, property)
+        __field(int, result)
+        __field(bool, cached)
+    ),
+
+    TP_fast_assign(
+        __entry->property = property;
+        __entry->result = result;
+        __entry->cached = cached;
+    ),
+
+    TP_printk("property=%d result=%d source=%s",
+        __entry->property,
+        __entry->result,
+        __entry->cached ? "cache" : "hardware"
+    )
+);
+
+/** A change notification of a power supply */
+TRACE_EVENT(battery_supply_changed,
+    TP_PROTO(const char *name),
+    TP_ARGS(name),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+    ),
+
+    TP_printk("supply=%s", __get_str(name))
+);
+
+#endif /* BATTERY_MODULE_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE battery-module-trace
+#include <trace/define_trace.h>
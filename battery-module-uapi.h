@@ -0,0 +1,125 @@
+/**
+ * Userspace interface of the battery driver for the Acer Switch 11 laptop.
+ *
+ * The character device /dev/acer-switch-battery provides two interfaces:
+ *
+ * Reading the device returns a single `struct battery_state_record` holding
+ * the current state. The first read after opening returns immediately (once
+ * the first sample of the battery succeeded), each further read blocks until
+ * the state changed (unless O_NONBLOCK is set, in which case -EAGAIN is
+ * returned). The device supports poll()/epoll, which signals readability if the
+ * state changed since the last read.
+ *
+ * The device can be mapped (read-only) to access the history of the battery
+ * samples without any copying. The mapping starts with a
+ * `struct battery_history_header` followed (at `data_offset`) by a ring of
+ * `size` entries of `struct battery_history_sample`.
+ *
+ * The sample with the sequence number n is located at index n % size. The
+ * header field `seq` holds the sequence number of the next sample to be
+ * written. Thus a consumer can catch up on all samples from its last known
+ * sequence number up to `seq` in bulk (as long as it is not more than `size`
+ * samples behind). The field `seq` of a sample is written before the sample is
+ * published, so a consumer can detect samples overwritten while reading by
+ * comparing it to the expected number.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef BATTERY_MODULE_UAPI_H
+#define BATTERY_MODULE_UAPI_H
+
+#include <linux/types.h>
+
+/** The path of the character device of the module */
+#define BATTERY_DEVICE_PATH "/dev/acer-switch-battery"
+
+/** The magic number at the start of the history mapping ("BATH") */
+#define BATTERY_HISTORY_MAGIC 0x48544142
+
+/** The version of the layout of the history mapping */
+#define BATTERY_HISTORY_VERSION 1
+
+/** The flags of a history sample or a state record */
+#define BATTERY_SAMPLE_AC_ONLINE (1 << 0)
+#define BATTERY_SAMPLE_STALE (1 << 1)
+/**
+ * A profiling sample (see the module parameter `profile_hz`): only the voltage
+ * and the current were read, the energy and the status are those of the latest
+ * regular sample.
+ */
+#define BATTERY_SAMPLE_PROFILE (1 << 2)
+
+/** The state of the battery and the AC adapter as returned by read() */
+struct battery_state_record {
+    /** A number incremented with every change of the state */
+    __u64 generation;
+    /** The time of the underlying sample in ns (CLOCK_MONOTONIC) */
+    __u64 timestamp_ns;
+    /** The energy in mWh */
+    __u32 energy;
+    /** The energy in mWh the last time the battery was full */
+    __u32 full_energy;
+    /** The voltage in mV */
+    __u32 voltage;
+    /** The (dis-)charging current in mA */
+    __u32 current_now;
+    /** The smoothed (dis-)charging power in uW */
+    __u32 power;
+    /** The estimated time until the battery is empty in seconds */
+    __u32 time_to_empty;
+    /** The estimated time until the battery is fully charged in seconds */
+    __u32 time_to_full;
+    /** The status (one of the POWER_SUPPLY_STATUS_* values) */
+    __u16 status;
+    /** A combination of the BATTERY_SAMPLE_* flags */
+    __u16 flags;
+    /** The capacity in % */
+    __u8 capacity;
+    /** The level of capacity (one of the POWER_SUPPLY_CAPACITY_LEVEL_*) */
+    __u8 capacity_level;
+    __u8 reserved[6];
+};
+
+/** The header at the start of the history mapping */
+struct battery_history_header {
+    /** Always `BATTERY_HISTORY_MAGIC` */
+    __u32 magic;
+    /** Always `BATTERY_HISTORY_VERSION` */
+    __u32 version;
+    /** The number of entries in the ring */
+    __u32 size;
+    /** The size of a single entry in bytes */
+    __u32 sample_size;
+    /** The offset of the first entry from the start of the mapping */
+    __u64 data_offset;
+    /** The sequence number of the next sample to be written */
+    __u64 seq;
+};
+
+/** A single sample of the battery history */
+struct battery_history_sample {
+    /** The sequence number of the sample */
+    __u64 seq;
+    /** The time of the sample in ns (CLOCK_MONOTONIC) */
+    __u64 timestamp_ns;
+    /** The energy in mWh */
+    __u32 energy;
+    /** The voltage in mV */
+    __u32 voltage;
+    /** The (dis-)charging current in mA */
+    __u32 current_now;
+    /** The status (one of the POWER_SUPPLY_STATUS_* values) */
+    __u16 status;
+    /** A combination of the BATTERY_SAMPLE_* flags */
+    __u16 flags;
+};
+
+#endif /* BATTERY_MODULE_UAPI_H */
@@ -23,84 +23,498 @@
 #include <linux/kernel.h>
 #include <linux/power_supply.h>
 #include <linux/i2c.h>
-#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/interrupt.h>
+#include <linux/gpio.h>
 #include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/seqlock.h>
+#include <linux/average.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/uaccess.h>
+#include <linux/random.h>
+#include <linux/pm_runtime.h>
+#include <linux/regmap.h>
+#include <linux/hrtimer.h>
+
+#include "battery-module-uapi.h"
+
+#define CREATE_TRACE_POINTS
+#include "battery-module-trace.h"
 
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("Julian Frimmel <julian.frimmel@gmail.com>");
 MODULE_DESCRIPTION("Module for fixing the battery on an Acer Switch 11 Laptop");
 MODULE_VERSION("1.0.0");
 
-/** The name that the battery should get in the sysfs */
+/** The names that the batteries should get in the sysfs */
 #define BATTERY_NAME "BAT0"
+#define DOCK_BATTERY_NAME "BAT1"
 
 /** The name that the AC adapter should get in the sysfs */
 #define AC_ADAPTER_NAME "ADP0"
 
 
-/** Bus number of the battery and the AC adapter (depends on used hardware) */
+/** Default bus number of the batteries and the AC adapter */
 #define I2C_BUS 1
 
-/** Bus address of the battery and the AC adapter (depends on used hardware) */
+/** Default bus addresses of the battery and the AC adapter */
 #define BATTERY_I2C_ADDRESS 0x70
 #define AC_ADAPTER_I2C_ADDRESS 0x30
 
+/** The maximum number of batteries (see `battery_table`) */
+#define BATTERY_MAX_INSTANCES 2
+
 #define BATTERY_REGISTER_STATUS 0xC1
 #define BATTERY_REGISTER_RATE 0xD0
 #define BATTERY_REGISTER_ENERGY 0xC2
 #define BATTERY_REGISTER_VOLTAGE 0xC6
 #define AC_ADAPTER_REGISTER 0x6F
 
+/**
+ * The register window containing all battery registers used by this module.
+ *
+ * It starts at the status register and ends with the MSB of the rate register.
+ */
+#define BATTERY_WINDOW_START BATTERY_REGISTER_STATUS
+#define BATTERY_WINDOW_END (BATTERY_REGISTER_RATE + 1)
+#define BATTERY_WINDOW_SIZE (BATTERY_WINDOW_END - BATTERY_WINDOW_START + 1)
+
+/**
+ * The battery registers, that may be fetched by a refresh.
+ *
+ * Each property depends on a set of them (see `battery_property_table`), so a
+ * refresh only fetches the registers of the properties actually queried.
+ */
+enum battery_fetch {
+    BATTERY_FETCH_STATUS,
+    BATTERY_FETCH_ENERGY,
+    BATTERY_FETCH_VOLTAGE,
+    BATTERY_FETCH_RATE,
+    BATTERY_FETCH_COUNT
+};
+
+/** Sets of registers to fetch */
+#define BATTERY_NEEDS(reg) BIT(BATTERY_FETCH_##reg)
+#define BATTERY_FETCH_POWER (BATTERY_NEEDS(VOLTAGE) | BATTERY_NEEDS(RATE))
+#define BATTERY_FETCH_ALL (BIT(BATTERY_FETCH_COUNT) - 1)
+
+
+/**
+ * The default time between two samples of the AC adapter state in milli
+ * seconds. This is only used, if no interrupt for plug events is available.
+ */
+#define AC_ADAPTER_DEFAULT_CHECK_RATE_MS 500
+
+/**
+ * The minimum interval of the periodic works in milli seconds. Shorter ones
+ * would let the works re-queue themselves back to back and flood the EC.
+ */
+#define BATTERY_MIN_INTERVAL_MS 10
+
+/** The default battery sampling intervals in milli seconds */
+#define BATTERY_DEFAULT_SAMPLE_FAST_MS 2000
+#define BATTERY_DEFAULT_SAMPLE_SLOW_MS 30000
 
-/** The time between two samples of the AC adapter state in milli seconds */
-#define AC_ADAPTER_CHECK_RATE_MS 500
+/** The default change of the rate (in mW), that is considered a sharp change */
+#define BATTERY_DEFAULT_RATE_CHANGE_MW 1000
 
 /** The maximum energy stored in the battery in mWh */
 #define BATTERY_DEFAULT_FULL_ENERGY 37500
 
+/** The number of attempts for each I2C transfer before giving up */
+#define BATTERY_MAX_TRIES 5
+
+/** The number of failed burst reads in a row before falling back for good */
+#define BATTERY_MAX_BURST_FAILURES 3
+
+/** The default delay before the first retry of a failed transfer in us */
+#define BATTERY_DEFAULT_RETRY_DELAY_US 500
+
+/** The default number of failed samples in a row, that opens the breaker */
+#define BATTERY_DEFAULT_BREAKER_THRESHOLD 3
+
+/** The default time in ms no transfers are issued after the breaker opened */
+#define BATTERY_DEFAULT_BREAKER_COOLDOWN_MS 10000
+
+/** The default interval in ms of re-synchronizing the energy model */
+#define BATTERY_DEFAULT_ENERGY_RESYNC_MS 300000
+
+/** The default number of entries of the sample history */
+#define BATTERY_DEFAULT_HISTORY_SIZE 1024
+
+/** The default time a battery snapshot is considered up to date in ms */
+#define BATTERY_DEFAULT_CACHE_TTL_MS 1000
+
+/** The default time a query waits for a refresh in progress in ms */
+#define BATTERY_DEFAULT_REFRESH_WAIT_MS 50
+
+/** The default autosuspend delay of the I2C devices in ms */
+#define BATTERY_DEFAULT_AUTOSUSPEND_MS 100
+
+/** The default budget of EC transactions per second */
+#define BATTERY_DEFAULT_I2C_BUDGET 100
+
+/** The default number of EC transactions, that may be issued at once */
+#define BATTERY_DEFAULT_I2C_BUDGET_BURST 20
+
+/** The maximum sample rate of the profiling mode in Hz */
+#define BATTERY_MAX_PROFILE_HZ 100
+
+/**
+ * The time in milli seconds a battery snapshot is served without re-reading
+ * the hardware. A value of 0 re-reads the registers on every query.
+ */
+static unsigned int cache_ttl_ms = BATTERY_DEFAULT_CACHE_TTL_MS;
+module_param(cache_ttl_ms, uint, 0644);
+MODULE_PARM_DESC(cache_ttl_ms,
+    "Time in ms a battery sample is reused for property queries (0: never)");
+
+/**
+ * The time in milli seconds a property query of an expired snapshot waits for
+ * the refresh. All queries arriving during a refresh wait for the same one, so
+ * the bus is accessed once regardless of the number of readers. A value of 0
+ * returns the expired snapshot immediately.
+ */
+static unsigned int refresh_wait_ms = BATTERY_DEFAULT_REFRESH_WAIT_MS;
+module_param(refresh_wait_ms, uint, 0644);
+MODULE_PARM_DESC(refresh_wait_ms,
+    "Time in ms a query of an expired sample waits for the refresh (0: never)");
+
 /**
- * The I2C bus of the battery.
+ * Whether the adapter of the battery only supports SMBus transfers.
  *
- * This has to be global, since it is used inside the initialization and exit
- * functions. Since they are callbacks, no parameter can be used. The only other
- * way to share this information is this (module-global) variable.
+ * This is determined once the devices are created (see
+ * `battery_select_transfers()`). Combined and burst reads are not available
+ * then, so the registers are read byte by byte using SMBus commands.
  */
-static struct i2c_adapter *i2c_bus;
+static bool battery_smbus_only;
 
 /**
- * The I2C device of the battery/AC adapter.
+ * Enable or disable a kind of transfer (`combined_reads` or `burst_reads`).
  *
- * This has to be global, since it is used inside the initialization and exit
- * functions. Since they are callbacks, no parameter can be used. The only other
- * way to share this information is this (module-global) variable.
+ * The transfers cannot be enabled, if the adapter only supports SMBus, since
+ * every such read would fail (after all its retries).
  */
-static struct i2c_client *battery_device;
-static struct i2c_client *ac_adapter_device;
+static int transfer_set(const char *value, const struct kernel_param *kp) {
+    bool enable;
+    int ret;
+
+    ret = kstrtobool(value, &enable);
+    if (ret)
+        return ret;
+    if (enable && READ_ONCE(battery_smbus_only))
+        return -EINVAL;
+
+    WRITE_ONCE(*(bool *)kp->arg, enable);
+    return 0;
+}
 
-/** The I2C slave information for the device tree */
-static struct i2c_board_info __initdata battery_info[] = {
-    {I2C_BOARD_INFO("acer-switch-battery", BATTERY_I2C_ADDRESS)}
+static const struct kernel_param_ops transfer_ops = {
+    .set = transfer_set,
+    .get = param_get_bool
 };
-static struct i2c_board_info __initdata ac_adapter_info[] = {
-    {I2C_BOARD_INFO("acer-switch-AC", AC_ADAPTER_I2C_ADDRESS)}
+
+/**
+ * Whether the register command and the read are combined into one transfer.
+ *
+ * This can be disabled, if the EC does not handle a repeated start condition.
+ */
+static bool combined_reads = true;
+module_param_cb(combined_reads, &transfer_ops, &combined_reads, 0644);
+MODULE_PARM_DESC(combined_reads,
+    "Read registers using a single write+read transfer (repeated start)");
+
+/**
+ * Whether the whole register window is read in a single block transfer.
+ *
+ * This is disabled automatically, if the EC repeatedly rejects the long read.
+ */
+static bool burst_reads = true;
+module_param_cb(burst_reads, &transfer_ops, &burst_reads, 0644);
+MODULE_PARM_DESC(burst_reads,
+    "Read all battery registers in a single block transfer");
+
+/**
+ * The interval in milli seconds of reading the energy register.
+ *
+ * In between the energy is modelled by integrating the power over time. A value
+ * of 0 reads the energy register with every sample. The register is always read
+ * in burst mode, since it is part of the register window anyway.
+ */
+static unsigned int energy_resync_ms = BATTERY_DEFAULT_ENERGY_RESYNC_MS;
+module_param(energy_resync_ms, uint, 0644);
+MODULE_PARM_DESC(energy_resync_ms,
+    "Interval in ms of re-synchronizing the energy model (0: every sample)");
+
+/**
+ * The delay before the first retry of a failed transfer in micro seconds.
+ *
+ * The delay is doubled for each further retry.
+ */
+static unsigned int retry_delay_us = BATTERY_DEFAULT_RETRY_DELAY_US;
+module_param(retry_delay_us, uint, 0644);
+MODULE_PARM_DESC(retry_delay_us,
+    "Delay in us before the first retry of a failed transfer");
+
+/**
+ * The circuit breaker of the battery bus.
+ *
+ * After `breaker_threshold` failed samples in a row, no transfers are issued
+ * for `breaker_cooldown_ms`. The last good snapshot is served (marked stale) in
+ * the meantime.
+ */
+static unsigned int breaker_threshold = BATTERY_DEFAULT_BREAKER_THRESHOLD;
+module_param(breaker_threshold, uint, 0644);
+MODULE_PARM_DESC(breaker_threshold,
+    "Failed samples in a row that suspend bus accesses (0: never)");
+
+static unsigned int breaker_cooldown_ms = BATTERY_DEFAULT_BREAKER_COOLDOWN_MS;
+module_param(breaker_cooldown_ms, uint, 0644);
+MODULE_PARM_DESC(breaker_cooldown_ms,
+    "Time in ms bus accesses are suspended after repeated failures");
+
+/**
+ * The budget of EC transactions (a token bucket).
+ *
+ * The bus is shared with other devices (e.g. the touch controller), so the
+ * transactions are limited to `i2c_budget` per second with bursts of up to
+ * `i2c_budget_burst` transactions. While the budget is used up, no samples are
+ * taken and the last snapshots are served instead (see `battery_sample_all()`).
+ */
+static unsigned int i2c_budget = BATTERY_DEFAULT_I2C_BUDGET;
+module_param(i2c_budget, uint, 0644);
+MODULE_PARM_DESC(i2c_budget,
+    "Maximum EC transactions per second (0: unlimited)");
+
+/**
+ * Set the burst size of the transaction budget.
+ *
+ * The burst size is the capacity of the bucket, so at least one transaction is
+ * required. Otherwise the budget would never allow an access.
+ */
+static int i2c_budget_burst_set(
+    const char *value,
+    const struct kernel_param *kp
+) {
+    unsigned int burst;
+    int ret;
+
+    ret = kstrtouint(value, 0, &burst);
+    if (ret)
+        return ret;
+    if (!burst)
+        return -EINVAL;
+
+    WRITE_ONCE(*(unsigned int *)kp->arg, burst);
+    return 0;
+}
+
+static const struct kernel_param_ops i2c_budget_burst_ops = {
+    .set = i2c_budget_burst_set,
+    .get = param_get_uint
 };
 
+static unsigned int i2c_budget_burst = BATTERY_DEFAULT_I2C_BUDGET_BURST;
+module_param_cb(i2c_budget_burst, &i2c_budget_burst_ops, &i2c_budget_burst,
+    0644);
+MODULE_PARM_DESC(i2c_budget_burst,
+    "Maximum EC transactions issued at once within the budget");
 
 /**
- * The power supply "battery".
+ * The bus and the addresses of the devices (they depend on the variant).
  *
- * This variable holds resource information about the registered power supply.
+ * The keyboard dock battery of some variants is only handled, if its address
+ * is given.
+ */
+static int i2c_bus_nr = I2C_BUS;
+module_param(i2c_bus_nr, int, 0444);
+MODULE_PARM_DESC(i2c_bus_nr, "Number of the I2C bus of the EC");
+
+static ushort battery_address = BATTERY_I2C_ADDRESS;
+module_param(battery_address, ushort, 0444);
+MODULE_PARM_DESC(battery_address, "I2C address of the battery");
+
+static ushort dock_address;
+module_param(dock_address, ushort, 0444);
+MODULE_PARM_DESC(dock_address,
+    "I2C address of the keyboard dock battery (0: none)");
+
+static ushort ac_address = AC_ADAPTER_I2C_ADDRESS;
+module_param(ac_address, ushort, 0444);
+MODULE_PARM_DESC(ac_address, "I2C address of the AC adapter");
+
+/**
+ * Whether the EC is emulated.
+ *
+ * If set, no I2C devices are created and all register accesses are served by
+ * an in-module emulation (see `battery_emulator_transfer()`). This allows to
+ * benchmark and test the driver on any machine.
+ */
+static bool emulate;
+module_param(emulate, bool, 0444);
+MODULE_PARM_DESC(emulate, "Emulate the EC instead of accessing the hardware");
+
+/** The latency of each emulated transfer in micro seconds */
+static unsigned int emu_latency_us = 200;
+module_param(emu_latency_us, uint, 0644);
+MODULE_PARM_DESC(emu_latency_us, "Latency in us of an emulated transfer");
+
+/** The probability of a failing emulated transfer in 1/1000 */
+static unsigned int emu_error_rate;
+module_param(emu_error_rate, uint, 0644);
+MODULE_PARM_DESC(emu_error_rate,
+    "Probability in 1/1000 of a failing emulated transfer");
+
+/**
+ * The scripted behavior of the emulated battery.
+ *
+ * "discharge" drains the battery (AC unplugged) down to 3%, "charge" charges
+ * it (AC plugged) until full and "cycle" alternates between discharging down
+ * to 10% and charging until full.
+ */
+static char *emu_profile = "cycle";
+module_param(emu_profile, charp, 0444);
+MODULE_PARM_DESC(emu_profile,
+    "Behavior of the emulated battery (discharge, charge or cycle)");
+
+/** The (dis-)charging power of the emulated battery in mW */
+static unsigned int emu_power_mw = 5000;
+module_param(emu_power_mw, uint, 0644);
+MODULE_PARM_DESC(emu_power_mw, "(Dis-)charging power in mW of the emulation");
+
+/** The factor by which the time of the emulated battery is accelerated */
+static unsigned int emu_speed = 1;
+module_param(emu_speed, uint, 0644);
+MODULE_PARM_DESC(emu_speed, "Time acceleration factor of the emulation");
+
+/**
+ * The delay in milli seconds before the I2C devices are suspended after a bus
+ * access. Accesses closer together than this (e.g. a battery sample and an AC
+ * poll) share a single wakeup of the bus controller.
+ */
+static unsigned int autosuspend_ms = BATTERY_DEFAULT_AUTOSUSPEND_MS;
+module_param(autosuspend_ms, uint, 0444);
+MODULE_PARM_DESC(autosuspend_ms,
+    "Delay in ms before the I2C bus is suspended after an access");
+
+/** The number of entries of the sample history ring buffer */
+static unsigned int history_size = BATTERY_DEFAULT_HISTORY_SIZE;
+module_param(history_size, uint, 0444);
+MODULE_PARM_DESC(history_size, "Number of samples kept in the history");
+
+/**
+ * The interrupt or GPIO signalling AC plug events (-1: none).
+ *
+ * If neither is given, the AC state is polled periodically instead.
+ */
+static int ac_irq = -1;
+module_param(ac_irq, int, 0444);
+MODULE_PARM_DESC(ac_irq, "Interrupt raised on AC plug events (-1: poll)");
+
+static int ac_gpio = -1;
+module_param(ac_gpio, int, 0444);
+MODULE_PARM_DESC(ac_gpio, "GPIO toggled on AC plug events (-1: poll)");
+
+/**
+ * Set the interval of a periodic work.
+ *
+ * Intervals below `BATTERY_MIN_INTERVAL_MS` are rejected. The new interval is
+ * used, once the work is queued the next time.
+ */
+static int interval_ms_set(const char *value, const struct kernel_param *kp) {
+    unsigned int interval;
+    int ret;
+
+    ret = kstrtouint(value, 0, &interval);
+    if (ret)
+        return ret;
+    if (interval < BATTERY_MIN_INTERVAL_MS)
+        return -EINVAL;
+
+    WRITE_ONCE(*(unsigned int *)kp->arg, interval);
+    return 0;
+}
+
+static const struct kernel_param_ops interval_ms_ops = {
+    .set = interval_ms_set,
+    .get = param_get_uint
+};
+
+/** The time between two samples of the polled AC state in milli seconds */
+static unsigned int ac_poll_ms = AC_ADAPTER_DEFAULT_CHECK_RATE_MS;
+module_param_cb(ac_poll_ms, &interval_ms_ops, &ac_poll_ms, 0644);
+MODULE_PARM_DESC(ac_poll_ms, "Interval in ms of AC state polling");
+
+/**
+ * The limits of the background battery sampling.
+ *
+ * The fast interval is used while charging or if the rate changed by more than
+ * `rate_change_mw` since the previous sample. Otherwise the slow interval is
+ * used.
+ */
+static unsigned int sample_fast_ms = BATTERY_DEFAULT_SAMPLE_FAST_MS;
+module_param_cb(sample_fast_ms, &interval_ms_ops, &sample_fast_ms, 0644);
+MODULE_PARM_DESC(sample_fast_ms,
+    "Sampling interval in ms while charging or on sharp rate changes");
+
+static unsigned int sample_slow_ms = BATTERY_DEFAULT_SAMPLE_SLOW_MS;
+module_param_cb(sample_slow_ms, &interval_ms_ops, &sample_slow_ms, 0644);
+MODULE_PARM_DESC(sample_slow_ms,
+    "Sampling interval in ms while the rate is stable");
+
+static unsigned int rate_change_mw = BATTERY_DEFAULT_RATE_CHANGE_MW;
+module_param(rate_change_mw, uint, 0644);
+MODULE_PARM_DESC(rate_change_mw,
+    "Change of the rate in mW that selects the fast sampling interval");
+
+/**
+ * The I2C device of the AC adapter.
+ *
+ * This has to be global, since it is used inside the initialization and exit
+ * functions. Since they are callbacks, no parameter can be used. The only other
+ * way to share this information is this (module-global) variable.
  */
-static struct power_supply *battery;
+static struct i2c_client *ac_adapter_device;
+
+/** An entry of the table of the batteries, that may be present */
+struct battery_table_entry {
+    /** The name of the power supply */
+    const char *name;
+    /** The model name reported by the power supply */
+    const char *model;
+    /** The bus address (a module parameter, 0 if the battery is absent) */
+    const ushort *address;
+};
+
+/** The table of the batteries, that may be present */
+static const struct battery_table_entry battery_table[BATTERY_MAX_INSTANCES] = {
+    {BATTERY_NAME, "Acer Switch 11 Battery by jfrimmel", &battery_address},
+    {DOCK_BATTERY_NAME, "Acer Switch Keyboard Dock Battery", &dock_address}
+};
 
 /** Available properties of the battery */
 static enum power_supply_property battery_properties[] = {
     POWER_SUPPLY_PROP_STATUS,
     POWER_SUPPLY_PROP_CAPACITY,
+    POWER_SUPPLY_PROP_CAPACITY_LEVEL,
     POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW,
     POWER_SUPPLY_PROP_TIME_TO_FULL_NOW,
     POWER_SUPPLY_PROP_VOLTAGE_NOW,
     POWER_SUPPLY_PROP_CURRENT_NOW,
+    POWER_SUPPLY_PROP_POWER_NOW,
+    POWER_SUPPLY_PROP_POWER_AVG,
     POWER_SUPPLY_PROP_PRESENT,
     POWER_SUPPLY_PROP_ENERGY_FULL,
     POWER_SUPPLY_PROP_ENERGY_NOW,
@@ -112,13 +526,53 @@ static enum power_supply_property battery_properties[] = {
     POWER_SUPPLY_PROP_MANUFACTURER
 };
 
+/**
+ * The I2C driver handling the devices of the battery and the AC adapter.
+ *
+ * The devices are created by the module itself (see
+ * `battery_create_devices()`), since the firmware does not describe them.
+ */
+static const struct i2c_device_id battery_i2c_ids[] = {
+    {"acer-switch-battery", 0},
+    {"acer-switch-AC", 0},
+    {}
+};
+MODULE_DEVICE_TABLE(i2c, battery_i2c_ids);
+
+static int battery_i2c_probe(struct i2c_client *, const struct i2c_device_id *);
+static int battery_i2c_remove(struct i2c_client *);
+static int battery_runtime_suspend(struct device *);
+static int battery_runtime_resume(struct device *);
+static int battery_suspend(struct device *);
+static int battery_resume(struct device *);
+
+static const struct dev_pm_ops battery_pm_ops = {
+    SET_SYSTEM_SLEEP_PM_OPS(battery_suspend, battery_resume)
+    SET_RUNTIME_PM_OPS(battery_runtime_suspend, battery_runtime_resume, NULL)
+};
+
+static struct i2c_driver battery_i2c_driver = {
+    .driver = {
+        .name = "acer-switch-battery",
+        .pm = &battery_pm_ops
+    },
+    .probe = battery_i2c_probe,
+    .remove = battery_i2c_remove,
+    .id_table = battery_i2c_ids
+};
+
+
 static int battery_get_property(
     struct power_supply*,
     enum power_supply_property,
     union power_supply_propval*
 );
 
-/** The descriptor of the battery device */
+/**
+ * The descriptor of the battery devices.
+ *
+ * Each battery uses a copy with its own name (see `battery_instance`).
+ */
 static const struct power_supply_desc battery_description = {
         .name = BATTERY_NAME,
         .type = POWER_SUPPLY_TYPE_BATTERY,
@@ -127,11 +581,311 @@ static const struct power_supply_desc battery_description = {
         .get_property = battery_get_property
 };
 
-/** The configuration of the battery device */
-static const struct power_supply_config battery_config = {};
+/** The raw content of the battery registers used by this module */
+struct battery_registers {
+    /** The values indexed by `enum battery_fetch` */
+    u16 values[BATTERY_FETCH_COUNT];
+    /** The registers read by the latest refresh (`BATTERY_NEEDS()` bits) */
+    unsigned int fetched;
+};
+
+/**
+ * The exponentially weighted moving average of the (dis-)charging power in uW.
+ *
+ * Each sample has a weight of 1/8. The average is only updated by the refresh
+ * worker and reset, whenever the status changes (e.g. from charging to
+ * discharging), since the power before is meaningless afterwards.
+ */
+DECLARE_EWMA(battery_power, 4, 8)
+
+/** The number of buckets of the latency histogram (powers of two in us) */
+#define BATTERY_LATENCY_BUCKETS 20
+
+/** Statistics of the transfers to a single battery register */
+struct battery_register_stats {
+    /** The number of transfers issued (including retries) */
+    u64 transfers;
+    /** The number of transfers, that failed */
+    u64 failures;
+    /** The number of transfers, that were retries of a failed one */
+    u64 retries;
+};
+
+/**
+ * Performance counters of the driver (exposed via debugfs).
+ *
+ * The counters of the transfers (`registers` and `latency`) are written by
+ * every bus access, including the register dump of the regmap debugfs, so they
+ * are protected by `battery_stats_lock`. All other members are only written by
+ * the refresh worker or the AC polling (which both run on the ordered driver
+ * workqueue) or under the lock of the transaction budget.
+ */
+struct battery_stats {
+    struct battery_register_stats registers[256];
+    /**
+     * Histogram of the I2C transfer latency. Bucket 0 counts transfers below
+     * 1 us, bucket n those between 2^(n-1) and 2^n us. The last bucket counts
+     * all longer transfers.
+     */
+    u64 latency[BATTERY_LATENCY_BUCKETS];
+    /** The number of refreshes of the snapshot */
+    u64 refreshes;
+    /** The total and maximum run time of the refreshes in ns */
+    u64 refresh_time_ns;
+    u64 refresh_max_ns;
+    /** The number of wakeups of the AC polling */
+    u64 ac_poll_wakeups;
+    /** The number of re-synchronizations of the energy model */
+    u64 energy_resyncs;
+    /** The absolute error of the energy model at the last re-sync in mWh */
+    u64 energy_drift_mwh;
+    /** The number of samples and AC polls skipped due to the budget */
+    u64 throttled;
+};
+static struct battery_stats battery_stats;
+static DEFINE_SPINLOCK(battery_stats_lock);
+
+/**
+ * The number of property queries served from a fresh (hit) or expired (miss)
+ * snapshot. These are per CPU, since the readers run concurrently.
+ */
+static DEFINE_PER_CPU(u64, battery_cache_hits);
+static DEFINE_PER_CPU(u64, battery_cache_misses);
+
+/**
+ * The number of misses, that joined a refresh requested by another query
+ * instead of requesting one on their own.
+ */
+static DEFINE_PER_CPU(u64, battery_cache_coalesced);
+
+/** The debugfs directory of the module */
+static struct dentry *battery_debugfs;
+
+/**
+ * The history of the battery samples.
+ *
+ * The buffer is mapped into userspace by the character device. It consists of
+ * the header (padded to a whole page) and the ring of samples (see the
+ * description in "battery-module-uapi.h"). It is only written by the refresh
+ * worker.
+ */
+static void *battery_history;
+static struct battery_history_header *battery_history_header;
+static struct battery_history_sample *battery_history_samples;
+static size_t battery_history_bytes;
+
+/**
+ * The generation of the battery state.
+ *
+ * It is incremented by the refresh worker whenever a new snapshot differs from
+ * the previous one. Readers of the character device wait on the queue.
+ */
+static atomic_t battery_state_generation = ATOMIC_INIT(1);
+static DECLARE_WAIT_QUEUE_HEAD(battery_state_wait);
+
+/** Account a single transfer in the statistics */
+static void battery_stats_transfer(
+    const u8 reg,
+    const int tries,
+    const bool failed,
+    const s64 latency_us
+) {
+    struct battery_register_stats *stats = &battery_stats.registers[reg];
+    unsigned int bucket = 0;
+
+    if (latency_us > 0)
+        bucket = min_t(unsigned int,
+            ilog2(latency_us) + 1,
+            BATTERY_LATENCY_BUCKETS - 1
+        );
+
+    spin_lock(&battery_stats_lock);
+    stats->transfers++;
+    if (tries)
+        stats->retries++;
+    if (failed)
+        stats->failures++;
+    battery_stats.latency[bucket]++;
+    spin_unlock(&battery_stats_lock);
+}
+
+/**
+ * A coherent sample of the battery state.
+ *
+ * All registers are read together by a single refresh, so every property that
+ * is served from the same snapshot is consistent with the others (e.g. the
+ * capacity always matches the reported energy within one uevent).
+ */
+struct battery_snapshot {
+    /** The decoded status (one of the POWER_SUPPLY_STATUS_* values) */
+    unsigned int status;
+    /** The current energy in mWh */
+    unsigned int energy;
+    /** The current voltage in mV */
+    unsigned int voltage;
+    /** The current (dis-)charging current in mA */
+    unsigned int current_now;
+    /** The instantaneous (dis-)charging power in uW */
+    unsigned int power_now;
+    /** The smoothed (dis-)charging power in uW (see `ewma_battery_power`) */
+    unsigned int power;
+    /** The energy in mWh the last time the battery was full */
+    unsigned int full_energy;
+    /** The state of the AC plug at the time of the sample */
+    unsigned int ac_online;
+
+    /*
+     * The derived values. They are calculated once, when the snapshot is
+     * taken (see `battery_derive_properties()`).
+     */
+    /** The capacity in % */
+    unsigned int capacity;
+    /** The level of capacity (one of the POWER_SUPPLY_CAPACITY_LEVEL_*) */
+    unsigned int capacity_level;
+    /** The estimated time until the battery is empty in seconds */
+    unsigned int time_to_empty;
+    /** The estimated time until the battery is fully charged in seconds */
+    unsigned int time_to_full;
+
+    /** The time (in jiffies) the snapshot was taken */
+    unsigned long timestamp;
+    /**
+     * The time (in jiffies) each register (see `enum battery_fetch`) was
+     * fetched. Registers not fetched by a refresh keep their older values.
+     */
+    unsigned long fetched_at[BATTERY_FETCH_COUNT];
+    /** The time (in ns, CLOCK_MONOTONIC) the snapshot was taken */
+    u64 time_ns;
+    /** Whether the snapshot contains data at all (i.e. any sample succeeded) */
+    bool valid;
+    /**
+     * Whether the values are not current: the latest refresh failed (the values
+     * are from an older one) or none succeeded since the system resumed.
+     */
+    bool stale;
+    /** Whether no refresh succeeded since the system resumed from sleep */
+    bool resumed;
+};
+
+/**
+ * The state of a single battery.
+ *
+ * All members except the snapshot are only accessed by the refresh worker
+ * (i.e. the sampling engine), unless noted otherwise.
+ */
+struct battery_instance {
+    /** The entry of the battery table describing the battery */
+    const struct battery_table_entry *entry;
+    /** The I2C device (NULL, if the EC is emulated) */
+    struct i2c_client *client;
+    /** The register map */
+    struct regmap *regmap;
+    /** The registered power supply and its descriptor */
+    struct power_supply *supply;
+    struct power_supply_desc description;
+
+    /**
+     * The most recent snapshot. Protected by `seqlock`.
+     *
+     * Snapshots are only written by the refresh worker, which holds the lock
+     * only while the new snapshot is copied in. Readers never take the lock:
+     * they copy the snapshot and retry, if it was modified in the meantime.
+     * Thus concurrent readers neither block each other nor write to a shared
+     * cache line.
+     */
+    struct battery_snapshot snapshot;
+    seqlock_t seqlock;
+
+    /** The smoothed (dis-)charging power in uW */
+    struct ewma_battery_power power_avg;
+    /**
+     * The modelled energy stored in the battery in uWh.
+     *
+     * It is re-synchronized with the energy register every `energy_resync_ms`
+     * and updated by integrating the power in between.
+     */
+    u64 energy_model;
+    /** The time (in jiffies) the energy model was re-synchronized */
+    unsigned long energy_synced;
+    /**
+     * The energy stored in the battery the last time it was full (in mWh).
+     *
+     * It is learned by the refresh worker (see `battery_learn_full_energy()`).
+     * The value of the main battery is exposed as the module parameter
+     * `full_energy_mwh`, so that userspace can save it and restore it when the
+     * module is loaded. It is always accessed using READ_ONCE()/WRITE_ONCE().
+     */
+    unsigned int last_full_energy;
+    /** The number of burst reads in a row, that failed */
+    unsigned int burst_failures;
+    /** The rate of the previous background sample (in uW) */
+    unsigned int last_rate;
+
+    /**
+     * The registers required by the properties queried since the last refresh
+     * (`BATTERY_NEEDS()` bits). It is updated by the queries.
+     */
+    atomic_t requested;
+    /**
+     * The registers requested before the last refresh. They are fetched once
+     * more, so that the queries of a burst (e.g. reading the uevent file) share
+     * a single refresh after the first one.
+     */
+    unsigned int interest;
+    /** The raw register values of the last refresh */
+    struct battery_registers registers;
+
+    /** The number of samples in a row, that failed */
+    unsigned int sample_failures;
+    /** The time (in jiffies) until which the circuit breaker is open */
+    unsigned long breaker_until;
+    /** Whether the circuit breaker is open (no transfers are issued) */
+    bool breaker_open;
+};
+
+/**
+ * The batteries handled by the driver.
+ *
+ * The first one is the main battery, which is always present. It provides the
+ * state of the character device and the sample history.
+ */
+static struct battery_instance battery_instances[BATTERY_MAX_INSTANCES] = {
+    [0 ... BATTERY_MAX_INSTANCES - 1] = {
+        .last_full_energy = BATTERY_DEFAULT_FULL_ENERGY
+    }
+};
+static unsigned int battery_instance_count;
+
+/** The main battery */
+#define battery_main (&battery_instances[0])
+
+/** Iterate over all batteries present */
+#define for_each_battery(battery) \
+    for ((battery) = battery_instances; \
+            (battery) < battery_instances + battery_instance_count; \
+            (battery)++)
+
+/**
+ * The state of the refresh requested by the property queries.
+ *
+ * `BATTERY_REFRESH_PENDING` is set by the query requesting a refresh and
+ * cleared by the refresh worker when it starts, so all queries arriving until
+ * then share that refresh (single flight). `BATTERY_REFRESH_FORCED` makes
+ * the worker sample even if the snapshot became fresh in the meantime.
+ * `BATTERY_REFRESH_STOPPED` is set before the supplies are unregistered, so no
+ * refresh notifies them any more (see `battery_stop_refresh()`).
+ */
+#define BATTERY_REFRESH_PENDING 0
+#define BATTERY_REFRESH_FORCED 1
+#define BATTERY_REFRESH_STOPPED 2
+static unsigned long battery_refresh_flags;
 
-/** Holds the energy stored in the battery the last time it was full */
-static unsigned int battery_last_full_energy = 37500;
+/**
+ * The number of snapshots published so far. Queries waiting for a refresh wait
+ * on the queue until it changes.
+ */
+static atomic_t battery_refresh_seq = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(battery_refresh_wait);
 
 
 /**
@@ -163,7 +917,8 @@ static const struct power_supply_desc ac_adapter_description = {
 
 /** A list of all power supplies, that are supplied from the AC plug */
 static char *ac_adapter_to[] = {
-    BATTERY_NAME
+    BATTERY_NAME,
+    DOCK_BATTERY_NAME
 };
 
 /**
@@ -177,345 +932,2837 @@ static const struct power_supply_config ac_adapter_config = {
     .num_supplicants = ARRAY_SIZE(ac_adapter_to)
 };
 
-/** Holds the current state of the AD adapter. */
+/**
+ * Holds the current state of the AD adapter.
+ *
+ * It is written by the AC adapter monitor only and always accessed using
+ * READ_ONCE()/WRITE_ONCE(), since it is read without any lock.
+ */
 static unsigned int ac_adapter_connected;
 
-/** The thread that periodically checks the AC adapter connection status */
-static struct task_struct *ac_adapter_thread;
+/** The interrupt used for AC plug events or -1, if the state is polled */
+static int ac_adapter_irq = -1;
 
 /**
- * Read a single byte from a battery register.
+ * The workqueue performing all periodic hardware accesses.
  *
- * The "special" register access operation is used, i.e. 0x80 is written to the
- * slave first, then the required sub-register and the the read of the byte.
+ * It is ordered, so the refresh, the sampling and the AC polling never run
+ * concurrently, and freezable, so it does not run during system sleep.
  */
-static u8 read_byte_register(const u8 reg) {
-    struct i2c_msg msg;
-    u8 bufo[8] = {0};
-    u8 value;
-    int ret;
-    int tries;
-    const int max_tries = 5;
+static struct workqueue_struct *battery_workqueue;
 
-    bufo[0] = 0x02;
-    bufo[1] = 0x80;
-    bufo[2] = reg;
-    msg.addr = battery_device->addr;
-    msg.len = 5;
-    msg.flags = 0;
-    msg.buf = bufo;
-    for (tries = 0; tries < max_tries; tries++) {
-        ret = i2c_transfer(battery_device->adapter, &msg, 1);
-        if (ret == 1)
-            break;
-        printk(KERN_ERR "Battery module: Write to register 0x%02X failed "
-                "(Result: 0x%02X, try %d/%d)\n",
-                reg, ret, tries + 1, max_tries
-        );
-    }
-    if (ret != 1) return 0x00;
+/**
+ * Whether the background sampling is running.
+ *
+ * It is set after the first sample after loading or system sleep and cleared
+ * before the sampling is stopped. Changes are serialized with the setters of
+ * the module parameters by the parameter lock, so a setter never uses the
+ * workqueue while the sampling is not running.
+ */
+static bool battery_sampling_active;
 
-    msg.addr = battery_device->addr;
-    msg.len = 1;
-    msg.flags = I2C_M_RD;
-    msg.buf = &value;
-    for (tries = 0; tries < max_tries; tries++) {
-        ret = i2c_transfer(battery_device->adapter, &msg, 1);
-        if (ret == 1)
-            break;
-        printk(KERN_ERR "Battery module: Read of register 0x%02X failed "
-                "(Result: 0x%02X, try %d/%d)\n",
-                reg, ret, tries + 1, max_tries
-        );
-    }
-    if (ret != 1) return 0x00;
+static void battery_refresh_work_func(struct work_struct *);
 
-    return value;
-}
+/** The work refreshing an expired snapshot on behalf of a property query */
+static DECLARE_WORK(battery_refresh_work, battery_refresh_work_func);
+
+static void battery_profile_work_func(struct work_struct *);
+
+/** The work taking the profiling samples (see `profile_hz`) */
+static DECLARE_WORK(battery_profile_work, battery_profile_work_func);
+
+static void ac_adapter_poll(struct work_struct *);
 
 /**
- * Read a single word from a battery register.
+ * The work that periodically checks the AC adapter connection status.
  *
- * The LSB is the register address, the MSB is register address + 1.
+ * The work is deferrable and runs on the (freezable) driver workqueue, so it is
+ * batched with other wakeups of an idle CPU and does not run while the system
+ * sleeps.
  */
-static inline u16 read_word_register(const u8 reg) {
-    return (read_byte_register(reg + 1) << 8) | read_byte_register(reg);
+static DECLARE_DEFERRABLE_WORK(ac_adapter_work, ac_adapter_poll);
+
+/** The state of the emulated EC. Protected by `battery_emulator_lock`. */
+static struct {
+    /** The battery registers */
+    u8 registers[256];
+    /** The register addressed by the last register access command */
+    u8 pointer;
+    /** The energy of the emulated battery in nWh */
+    u64 energy;
+    /** The direction of the current (true while charging) */
+    bool charging;
+    /** The time (in ns) the emulation was updated the last time */
+    u64 updated;
+} battery_emulator;
+static DEFINE_MUTEX(battery_emulator_lock);
+
+/** Write a little endian word into the emulated registers */
+static void battery_emulator_set_word(const u8 reg, const u16 value) {
+    battery_emulator.registers[reg] = value & 0xFF;
+    battery_emulator.registers[reg + 1] = value >> 8;
 }
 
+/**
+ * Advance the emulated battery to the current time.
+ *
+ * The energy is integrated using the configured power and the profile decides
+ * when to switch between charging and discharging. Afterwards the registers
+ * are updated from the emulated state.
+ */
+static void battery_emulator_update(void) {
+    const u64 now = ktime_get_ns();
+    const u64 full = BATTERY_DEFAULT_FULL_ENERGY * 1000000ULL;
+    const bool cycle = !strcmp(emu_profile, "cycle");
+    const bool charge = !strcmp(emu_profile, "charge");
+    unsigned int voltage;
+    unsigned int current_ma;
+    u8 status;
+
+    if (!battery_emulator.updated) {
+        battery_emulator.energy = charge ? full / 2 : full;
+        battery_emulator.charging = charge;
+        battery_emulator.updated = now;
+    } else {
+        /* only whole milli seconds are consumed, the rest is kept */
+        const u64 elapsed_ms = div_u64(
+            now - battery_emulator.updated,
+            NSEC_PER_MSEC
+        );
+        /* uW * ms = 1/3600 nWh */
+        const u64 delta = div_u64(
+            elapsed_ms * emu_speed * emu_power_mw * 1000ULL,
+            3600
+        );
 
-/** Read the current energy in mWh */
-static inline unsigned int battery_energy(void) {
-    return read_word_register(BATTERY_REGISTER_ENERGY) * 10;
-}
+        battery_emulator.updated += elapsed_ms * NSEC_PER_MSEC;
+        if (battery_emulator.charging) {
+            battery_emulator.energy =
+                min(battery_emulator.energy + delta, full);
+            if (cycle && battery_emulator.energy == full)
+                battery_emulator.charging = false;
+        } else {
+            const u64 lower = div_u64(full * (cycle ? 10 : 3), 100);
+            const u64 above = battery_emulator.energy > lower ?
+                battery_emulator.energy - lower : 0;
+
+            battery_emulator.energy -= min(delta, above);
+            if (cycle && battery_emulator.energy <= lower)
+                battery_emulator.charging = true;
+        }
+    }
 
-/** Read the last full energy in mWh */
-static inline unsigned int battery_energy_full(void) {
-    return battery_last_full_energy;
-}
+    /* a 2-cell Li-Ion battery from 7.0 V (empty) to 8.4 V (full) */
+    voltage = 7000 + div64_u64(battery_emulator.energy * 1400, full);
+    current_ma = emu_power_mw * 1000 / voltage;
+    if (battery_emulator.charging && battery_emulator.energy == full) {
+        status = 0x00;
+        current_ma = 0;
+    } else if (battery_emulator.charging) {
+        status = 0x02;
+    } else {
+        status = 0x01;
+        current_ma = (0x10000 - current_ma) & 0xFFFF;
+    }
 
-/** Read the current voltage in mV */
-static inline unsigned int battery_voltage(void) {
-    return read_word_register(BATTERY_REGISTER_VOLTAGE);
+    /* the energy register counts in units of 10 mWh */
+    battery_emulator.registers[BATTERY_REGISTER_STATUS] = status;
+    battery_emulator_set_word(
+        BATTERY_REGISTER_ENERGY,
+        div_u64(battery_emulator.energy, 10000000)
+    );
+    battery_emulator_set_word(BATTERY_REGISTER_VOLTAGE, voltage);
+    battery_emulator_set_word(BATTERY_REGISTER_RATE, current_ma);
 }
 
-/** Read the current in mA */
-static unsigned int battery_current(void) {
-    unsigned int rate;
-    rate = read_word_register(BATTERY_REGISTER_RATE);
+/**
+ * Delay an emulated transfer and decide, whether it fails.
+ *
+ * The function returns 0 or -EIO (if an error was injected).
+ */
+static int battery_emulator_access(void) {
+    if (emu_latency_us)
+        usleep_range(emu_latency_us, emu_latency_us + emu_latency_us / 4 + 1);
+    if (emu_error_rate && prandom_u32_max(1000) < emu_error_rate)
+        return -EIO;
+    return 0;
+}
+
+/**
+ * Emulate an I2C transfer to the battery.
+ *
+ * A written register access command (0x02, 0x80, register) selects the
+ * register, subsequent reads return consecutive registers starting there.
+ *
+ * The function returns the number of transferred messages or a negative error
+ * code (just like `i2c_transfer()`).
+ */
+static int battery_emulator_transfer(struct i2c_msg *msgs, const int num) {
+    int ret;
+    int i;
+
+    ret = battery_emulator_access();
+    if (ret)
+        return ret;
+
+    mutex_lock(&battery_emulator_lock);
+    battery_emulator_update();
+    for (i = 0; i < num; i++) {
+        struct i2c_msg *msg = &msgs[i];
+
+        if (msg->flags & I2C_M_RD) {
+            u16 j;
+
+            for (j = 0; j < msg->len; j++)
+                msg->buf[j] = battery_emulator.registers[
+                    (u8)(battery_emulator.pointer + j)
+                ];
+        } else if (msg->len >= 3 && msg->buf[0] == 0x02 &&
+                msg->buf[1] == 0x80) {
+            battery_emulator.pointer = msg->buf[2];
+        } else {
+            ret = -EIO;
+            break;
+        }
+    }
+    mutex_unlock(&battery_emulator_lock);
+
+    return ret ? ret : num;
+}
+
+/**
+ * Emulate the SMBus read of the AC adapter register.
+ *
+ * The AC adapter is plugged in, while the emulated battery is charging.
+ */
+static s32 battery_emulator_read_ac(void) {
+    s32 ret;
+
+    ret = battery_emulator_access();
+    if (ret)
+        return ret;
+
+    mutex_lock(&battery_emulator_lock);
+    battery_emulator_update();
+    ret = battery_emulator.charging ? 0x10 : 0x00;
+    mutex_unlock(&battery_emulator_lock);
+
+    return ret;
+}
+
+/**
+ * Take a runtime PM reference of an I2C device for the duration of an access.
+ *
+ * This resumes the device, which holds a reference of its bus controller
+ * while it is active (see `battery_runtime_resume()`). The reference is dropped
+ * by `battery_bus_put()`, which suspends the device once `autosuspend_ms`
+ * passed without another access. Nothing is done, if the EC is emulated.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int battery_bus_get(struct i2c_client *client) {
+    int ret;
+
+    if (emulate)
+        return 0;
+
+    ret = pm_runtime_get_sync(&client->dev);
+    if (ret < 0) {
+        pm_runtime_put_noidle(&client->dev);
+        printk_ratelimited(KERN_ERR "Battery module: Could not resume the "
+                "I2C device (Result: %d)\n", ret
+        );
+        return ret;
+    }
+    return 0;
+}
+
+/** Release the runtime PM reference taken by `battery_bus_get()` */
+static void battery_bus_put(struct i2c_client *client) {
+    if (emulate)
+        return;
+
+    pm_runtime_mark_last_busy(&client->dev);
+    pm_runtime_put_autosuspend(&client->dev);
+}
+
+/**
+ * The tokens of the transaction budget in 1/1000 transactions.
+ *
+ * The bucket is refilled with `i2c_budget` tokens per second up to
+ * `i2c_budget_burst` tokens. Every transaction takes a token. A sample, that
+ * was started, is always completed, so the bucket may run into debt, which
+ * delays the following samples. Protected by `battery_budget_lock`, since the
+ * AC adapter may be read outside of the driver workqueue.
+ */
+static long battery_budget_tokens;
+static unsigned long battery_budget_updated;
+static DEFINE_SPINLOCK(battery_budget_lock);
+
+/** Refill the transaction budget (called with `battery_budget_lock` held) */
+static void battery_budget_refill(void) {
+    const unsigned long now = jiffies;
+    const long capacity = READ_ONCE(i2c_budget_burst) * 1000L;
+    /* an hour refills any sensible bucket (and avoids overflows) */
+    const unsigned long elapsed =
+        min_t(unsigned long, now - battery_budget_updated, 3600UL * HZ);
+    const u64 refill = (u64)jiffies_to_msecs(elapsed) * READ_ONCE(i2c_budget);
+
+    battery_budget_tokens = min_t(s64,
+        battery_budget_tokens + (s64)min_t(u64, refill, capacity * 2ULL),
+        capacity
+    );
+    battery_budget_updated = now;
+}
+
+/** Fill the transaction budget completely (e.g. when loading the module) */
+static __init void battery_budget_reset(void) {
+    spin_lock(&battery_budget_lock);
+    battery_budget_tokens = READ_ONCE(i2c_budget_burst) * 1000L;
+    battery_budget_updated = jiffies;
+    spin_unlock(&battery_budget_lock);
+}
+
+/**
+ * Check, whether the transaction budget allows bus accesses.
+ *
+ * Denied accesses are counted in the statistics.
+ */
+static bool battery_budget_allows_access(void) {
+    bool allowed;
+
+    if (!READ_ONCE(i2c_budget))
+        return true;
+
+    spin_lock(&battery_budget_lock);
+    battery_budget_refill();
+    allowed = battery_budget_tokens > 0;
+    if (!allowed)
+        battery_stats.throttled++;
+    spin_unlock(&battery_budget_lock);
+    return allowed;
+}
+
+/**
+ * Take a token of the transaction budget for a transaction.
+ *
+ * The transactions of the profiling mode are not charged (see
+ * `battery_profile_work_func()`).
+ */
+static void battery_budget_charge(void) {
+    if (!READ_ONCE(i2c_budget) || current_work() == &battery_profile_work)
+        return;
+
+    spin_lock(&battery_budget_lock);
+    battery_budget_refill();
+    /* the debt is limited, so the budget recovers within a burst period */
+    battery_budget_tokens = max(
+        battery_budget_tokens - 1000,
+        -READ_ONCE(i2c_budget_burst) * 1000L
+    );
+    spin_unlock(&battery_budget_lock);
+}
+
+/**
+ * Perform a transfer to the battery using SMBus commands.
+ *
+ * Only single messages are supported: a write is sent as an I2C block write
+ * (the first byte is the command), a read of a single byte as a receive byte
+ * command. These are exactly the messages of the separate register reads.
+ *
+ * The function returns the number of transferred messages or a negative error
+ * code (just like `i2c_transfer()`).
+ */
+static int battery_smbus_transfer(
+    struct i2c_client *client,
+    struct i2c_msg *msgs,
+    const int num
+) {
+    s32 ret;
+
+    if (num != 1)
+        return -EOPNOTSUPP;
+
+    if (msgs->flags & I2C_M_RD) {
+        if (msgs->len != 1)
+            return -EOPNOTSUPP;
+        ret = i2c_smbus_read_byte(client);
+        if (ret < 0)
+            return ret;
+        msgs->buf[0] = ret;
+        return 1;
+    }
+
+    if (msgs->len < 2)
+        return -EOPNOTSUPP;
+    ret = i2c_smbus_write_i2c_block_data(
+        client,
+        msgs->buf[0],
+        msgs->len - 1,
+        msgs->buf + 1
+    );
+    return ret < 0 ? ret : 1;
+}
+
+/** Transfer messages to a battery (or the emulated EC) */
+static inline int battery_i2c_transfer(
+    struct battery_instance *battery,
+    struct i2c_msg *msgs,
+    const int num
+) {
+    if (emulate)
+        return battery_emulator_transfer(msgs, num);
+    if (battery_smbus_only)
+        return battery_smbus_transfer(battery->client, msgs, num);
+    return i2c_transfer(battery->client->adapter, msgs, num);
+}
+
+/**
+ * Perform an I2C transfer to a battery with retries.
+ *
+ * Failed attempts are repeated after an exponentially growing delay (starting
+ * at `retry_delay_us`), so that a busy EC is not hammered with requests. The
+ * failures are logged ratelimited.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int battery_transfer(
+    struct battery_instance *battery,
+    struct i2c_msg *msgs,
+    const int num,
+    const u8 reg,
+    const char *operation
+) {
+    unsigned int delay = retry_delay_us;
+    int ret;
+    int tries;
+    const int max_tries = BATTERY_MAX_TRIES;
+
+    for (tries = 0; tries < max_tries; tries++) {
+        ktime_t start;
+        s64 duration;
+
+        if (tries) {
+            usleep_range(delay, 2 * delay);
+            delay *= 2;
+        }
+        battery_budget_charge();
+        start = ktime_get();
+        ret = battery_i2c_transfer(battery, msgs, num);
+        duration = ktime_to_ns(ktime_sub(ktime_get(), start));
+        battery_stats_transfer(reg, tries, ret != num, duration / 1000);
+        if (msgs[num - 1].flags & I2C_M_RD)
+            trace_battery_register_read(
+                reg,
+                msgs[num - 1].buf,
+                msgs[num - 1].len,
+                ret == num ? 0 : (ret < 0 ? ret : -EIO),
+                tries + 1,
+                duration
+            );
+        if (ret == num)
+            return 0;
+        printk_ratelimited(KERN_DEBUG "Battery module: %s of register 0x%02X "
+                "failed (Result: %d, try %d/%d)\n",
+                operation, reg, ret, tries + 1, max_tries
+        );
+    }
+    printk_ratelimited(KERN_ERR "Battery module: %s of register 0x%02X "
+            "failed after %d tries (Result: %d)\n",
+            operation, reg, max_tries, ret
+    );
+    return ret < 0 ? ret : -EIO;
+}
+
+/**
+ * Read a single byte from a battery register using two separate transfers.
+ *
+ * The "special" register access operation is used, i.e. 0x80 is written to the
+ * slave first, then the required sub-register and the the read of the byte.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int read_byte_register_separate(
+    struct battery_instance *battery,
+    const u8 reg,
+    u8 *value
+) {
+    struct i2c_msg msg;
+    u8 bufo[8] = {0};
+    int ret;
+
+    bufo[0] = 0x02;
+    bufo[1] = 0x80;
+    bufo[2] = reg;
+    msg.addr = *battery->entry->address;
+    msg.len = 5;
+    msg.flags = 0;
+    msg.buf = bufo;
+    ret = battery_transfer(battery, &msg, 1, reg, "Write");
+    if (ret)
+        return ret;
+
+    msg.addr = *battery->entry->address;
+    msg.len = 1;
+    msg.flags = I2C_M_RD;
+    msg.buf = value;
+    return battery_transfer(battery, &msg, 1, reg, "Read");
+}
+
+/**
+ * Read consecutive battery registers in a single I2C transfer.
+ *
+ * The register access command (0x02, 0x80, register) and the read of `len`
+ * bytes are sent as two messages joined by a repeated start condition. This
+ * costs a single bus transaction and no register can change between the bytes
+ * of the result.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int read_register_block(
+    struct battery_instance *battery,
+    const u8 reg,
+    u8 *buf,
+    const u16 len
+) {
+    const u16 address = *battery->entry->address;
+    u8 command[3] = {0x02, 0x80, reg};
+    struct i2c_msg msgs[2] = {
+        {
+            .addr = address,
+            .flags = 0,
+            .len = sizeof(command),
+            .buf = command
+        },
+        {
+            .addr = address,
+            .flags = I2C_M_RD,
+            .len = len,
+            .buf = buf
+        }
+    };
+
+    return battery_transfer(
+        battery,
+        msgs,
+        ARRAY_SIZE(msgs),
+        reg,
+        "Combined read"
+    );
+}
+
+/**
+ * Read consecutive battery registers on behalf of regmap.
+ *
+ * This implements the indirect register access of the EC for the regmap bus.
+ * The context is the battery. The combined transfer is used if enabled.
+ * Otherwise (or if it failed) bytes and words are read using separate
+ * transfers, the MSB first. Longer reads (the burst of the register window)
+ * are not split up, since the caller falls back to reading the registers one
+ * by one instead.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int battery_regmap_read(
+    void *context,
+    const void *reg_buf,
+    size_t reg_size,
+    void *val_buf,
+    size_t val_size
+) {
+    struct battery_instance *battery = context;
+    const u8 reg = *(const u8 *)reg_buf;
+    u8 *value = val_buf;
+    int ret = -EIO;
+    int i;
+
+    if (combined_reads) {
+        ret = read_register_block(battery, reg, value, val_size);
+        if (!ret)
+            return 0;
+    }
+    if (val_size > 2)
+        return ret;
+
+    for (i = val_size - 1; i >= 0; i--) {
+        ret = read_byte_register_separate(battery, reg + i, &value[i]);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/** Reject writes on behalf of regmap (the driver never writes to the EC) */
+static int battery_regmap_write(void *context, const void *data, size_t count) {
+    return -EOPNOTSUPP;
+}
+
+/** The regmap bus implementing the register access protocol of the EC */
+static const struct regmap_bus battery_regmap_bus = {
+    .read = battery_regmap_read,
+    .write = battery_regmap_write
+};
+
+/**
+ * Check, whether a register may be read.
+ *
+ * Only the register window is read, which contains the live values of the
+ * battery. Thus nothing is cached and bulk reads of it are issued as a single
+ * read of the bus. This also limits the register dump of the regmap debugfs
+ * to the window, so it does not issue a read for every other register of the
+ * EC.
+ */
+static bool battery_regmap_readable(struct device *dev, unsigned int reg) {
+    return reg >= BATTERY_WINDOW_START && reg <= BATTERY_WINDOW_END;
+}
+
+/** Check, whether a register may be written (never) */
+static bool battery_regmap_writeable(struct device *dev, unsigned int reg) {
+    return false;
+}
+
+/** The register map of the batteries */
+static const struct regmap_config battery_regmap_config = {
+    .name = "battery",
+    .reg_bits = 8,
+    .val_bits = 8,
+    .max_register = BATTERY_WINDOW_END,
+    .readable_reg = battery_regmap_readable,
+    .writeable_reg = battery_regmap_writeable
+};
+
+/**
+ * Read a single byte from a battery register.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int battery_read_byte(
+    struct battery_instance *battery,
+    const u8 reg,
+    u8 *value
+) {
+    unsigned int data;
+    int ret;
+
+    ret = regmap_read(battery->regmap, reg, &data);
+    if (ret)
+        return ret;
+    *value = data;
+    return 0;
+}
+
+/**
+ * Read a single word from a battery register.
+ *
+ * The LSB is the register address, the MSB is register address + 1. Both bytes
+ * are read within a single transfer, if combined reads are enabled.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int battery_read_word(
+    struct battery_instance *battery,
+    const u8 reg,
+    u16 *value
+) {
+    u8 buf[2];
+    int ret;
+
+    ret = regmap_bulk_read(battery->regmap, reg, buf, sizeof(buf));
+    if (ret)
+        return ret;
+    *value = (buf[1] << 8) | buf[0];
+    return 0;
+}
+
+
+/** The location of a register, that may be fetched */
+struct battery_register_desc {
+    u8 reg;
+    /** The size in bytes (words are stored LSB first) */
+    u8 size;
+};
+
+/** The registers, that may be fetched (indexed by `enum battery_fetch`) */
+static const struct battery_register_desc
+battery_register_table[BATTERY_FETCH_COUNT] = {
+    [BATTERY_FETCH_STATUS] = {BATTERY_REGISTER_STATUS, 1},
+    [BATTERY_FETCH_ENERGY] = {BATTERY_REGISTER_ENERGY, 2},
+    [BATTERY_FETCH_VOLTAGE] = {BATTERY_REGISTER_VOLTAGE, 2},
+    [BATTERY_FETCH_RATE] = {BATTERY_REGISTER_RATE, 2}
+};
+
+/**
+ * Read the battery registers in a single burst.
+ *
+ * The part of the register window spanning all registers in `fetch` is read
+ * using one block transfer (it is volatile, so regmap reads it from the bus at
+ * once). All registers inside that span are decoded, since they come for free.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int battery_read_window(
+    struct battery_instance *battery,
+    struct battery_registers *registers,
+    const unsigned int fetch
+) {
+    u8 window[BATTERY_WINDOW_SIZE];
+    unsigned int start = BATTERY_WINDOW_END;
+    unsigned int end = BATTERY_WINDOW_START;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < BATTERY_FETCH_COUNT; i++) {
+        const struct battery_register_desc *desc = &battery_register_table[i];
+
+        if (!(fetch & BIT(i)))
+            continue;
+        start = min_t(unsigned int, start, desc->reg);
+        end = max_t(unsigned int, end, desc->reg + desc->size - 1);
+    }
+
+    ret = regmap_bulk_read(
+        battery->regmap,
+        start,
+        window,
+        end - start + 1
+    );
+    if (ret)
+        return ret;
+
+    for (i = 0; i < BATTERY_FETCH_COUNT; i++) {
+        const struct battery_register_desc *desc = &battery_register_table[i];
+        const u8 *value = &window[desc->reg - start];
+
+        if (desc->reg < start || desc->reg + desc->size - 1 > end)
+            continue;
+        registers->values[i] = desc->size == 2 ?
+            (value[1] << 8) | value[0] :
+            value[0];
+        registers->fetched |= BIT(i);
+    }
+    return 0;
+}
+
+/**
+ * Read the battery registers in `fetch` one by one.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int battery_read_single_registers(
+    struct battery_instance *battery,
+    struct battery_registers *registers,
+    const unsigned int fetch
+) {
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < BATTERY_FETCH_COUNT; i++) {
+        const struct battery_register_desc *desc = &battery_register_table[i];
+        u8 byte;
+
+        if (!(fetch & BIT(i)))
+            continue;
+        if (desc->size == 2) {
+            ret = battery_read_word(battery, desc->reg, &registers->values[i]);
+        } else {
+            ret = battery_read_byte(battery, desc->reg, &byte);
+            registers->values[i] = byte;
+        }
+        if (ret)
+            return ret;
+        registers->fetched |= BIT(i);
+    }
+    return 0;
+}
+
+/**
+ * Read the raw values of the battery registers in `fetch`.
+ *
+ * A burst read is preferred, if it is enabled. If it fails, the registers are
+ * read one by one. If the burst failed several times in a row while the single
+ * reads succeeded, it is assumed that the EC does not support long reads and
+ * the burst mode is disabled.
+ *
+ * The registers actually read are marked in `fetched` (a burst may read more
+ * than requested).
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int battery_read_registers(
+    struct battery_instance *battery,
+    struct battery_registers *registers,
+    const unsigned int fetch
+) {
+    int ret;
+
+    if (!burst_reads)
+        return battery_read_single_registers(battery, registers, fetch);
+
+    if (!battery_read_window(battery, registers, fetch)) {
+        battery->burst_failures = 0;
+        return 0;
+    }
+
+    ret = battery_read_single_registers(battery, registers, fetch);
+    if (!ret && ++battery->burst_failures >= BATTERY_MAX_BURST_FAILURES) {
+        printk(KERN_WARNING "Battery module: Burst reads of %s failed %u "
+                "times, falling back to single register reads\n",
+                battery->entry->name, battery->burst_failures
+        );
+        burst_reads = false;
+        battery->burst_failures = 0;
+    }
+    return ret;
+}
+
+/** Decode the energy in mWh */
+static inline unsigned int battery_energy(const u16 raw) {
+    return raw * 10;
+}
+
+/** Decode the current in mA */
+static unsigned int battery_current(const u16 raw) {
+    unsigned int rate = raw;
     if (rate > 0x7FFF) rate = 0x10000 - rate;
 
-    return rate;
+    return rate;
+}
+
+/** Calculate the current (dis-)charging rate in mW */
+static inline unsigned int battery_rate(
+    const struct battery_snapshot *snapshot
+) {
+    return snapshot->current_now * snapshot->voltage;
+}
+
+/** Decode the battery status (charging, discharging, full or unknown) */
+static unsigned int battery_status(const u8 status) {
+    if (status & 0x01) {
+        return POWER_SUPPLY_STATUS_DISCHARGING;
+    } else if (status & 0x02) {
+        return POWER_SUPPLY_STATUS_CHARGING;
+    } else if ((status & 0x03) == 0x00) {
+        return POWER_SUPPLY_STATUS_FULL;
+    } else {
+        return POWER_SUPPLY_STATUS_UNKNOWN;
+    }
+}
+
+/**
+ * Learn the energy of the full battery from a sample.
+ *
+ * This is done once per sample, if the battery is full and the energy register
+ * was read (the modelled energy is not precise enough). Values below 90% of the
+ * designed energy are ignored, since the EC reports "full" a bit too early at
+ * times.
+ */
+static void battery_learn_full_energy(
+    struct battery_instance *battery,
+    const struct battery_registers *registers,
+    const unsigned int status
+) {
+    const unsigned int energy =
+        battery_energy(registers->values[BATTERY_FETCH_ENERGY]);
+
+    if (status != POWER_SUPPLY_STATUS_FULL)
+        return;
+    if (!(registers->fetched & BATTERY_NEEDS(ENERGY)))
+        return;
+    /* allow 10% tolerance */
+    if (energy >= BATTERY_DEFAULT_FULL_ENERGY * 90 / 100)
+        WRITE_ONCE(battery->last_full_energy, energy);
+}
+
+/** Calculate the capacity in % (energy compared to energy if full) */
+static unsigned int battery_capacity(const struct battery_snapshot *snapshot) {
+    unsigned int last_full = snapshot->full_energy;
+    if (unlikely(!last_full)) {
+        return 0;
+    } else {
+        unsigned int capacity;
+        /* rounded division */
+        capacity = (100 * snapshot->energy + last_full / 2) / last_full;
+
+        return unlikely(capacity > 100) ? 100 : capacity;
+    }
+}
+
+/**
+ * Calculate the level of capacity. Calculation based on fixed thresholds.
+ *
+ * The capacity of the snapshot has to be calculated already.
+ */
+static unsigned int battery_capaity_level(
+    const struct battery_snapshot *snapshot
+) {
+    if (snapshot->status == POWER_SUPPLY_STATUS_FULL) {
+        return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
+    } else {
+        const unsigned int capacity = snapshot->capacity;
+        if (capacity >= 99)
+            return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
+        else if (capacity <= 5)
+            return POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
+        else if (capacity <= 15)
+            return POWER_SUPPLY_CAPACITY_LEVEL_LOW;
+        else
+            return POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+    }
+}
+
+/** Calculate the estimated time until the battery is empty */
+static unsigned int battery_time_to_empty(
+    const struct battery_snapshot *snapshot
+) {
+    unsigned int rate = snapshot->power;
+    if (unlikely(!rate))
+        return 0;
+    return snapshot->energy * 60ULL * 60ULL * 1000ULL / rate;
+}
+
+/**
+ * Read the state of the AC plug.
+ *
+ * The function returns 0 on success or a negative error code. `online` is left
+ * untouched on failure.
+ */
+static int ac_adapter_online(unsigned int *online) {
+    s32 data;
+    int ret;
+
+    battery_budget_charge();
+    if (emulate) {
+        data = battery_emulator_read_ac();
+    } else {
+        ret = battery_bus_get(ac_adapter_device);
+        if (ret)
+            return ret;
+        data = i2c_smbus_read_byte_data(ac_adapter_device, AC_ADAPTER_REGISTER);
+        battery_bus_put(ac_adapter_device);
+    }
+    if (data < 0)
+        return data;
+
+    *online = data & 0x10 ? 1 : 0;
+    return 0;
+}
+
+/** Calculate the estimated time until the battery is fully charged */
+static unsigned int battery_time_to_full(
+    const struct battery_snapshot *snapshot
+) {
+    int energy_missing;
+    unsigned int rate;
+    if (!snapshot->ac_online)
+        return 0;
+
+    rate = snapshot->power;
+    if (unlikely(!rate))
+        return 0;
+
+    energy_missing = snapshot->full_energy - snapshot->energy;
+    if (unlikely(energy_missing < 0))
+        energy_missing = 0;
+
+    return energy_missing * 60ULL * 60ULL * 1000ULL / rate;
+}
+
+/**
+ * Calculate all derived values of a snapshot.
+ *
+ * This is done once per snapshot, so the property queries only copy values and
+ * no derived value is ever calculated twice.
+ */
+static void battery_derive_properties(struct battery_snapshot *snapshot) {
+    snapshot->capacity = battery_capacity(snapshot);
+    snapshot->capacity_level = battery_capaity_level(snapshot);
+    snapshot->time_to_empty = battery_time_to_empty(snapshot);
+    snapshot->time_to_full = battery_time_to_full(snapshot);
+}
+
+/**
+ * Check, whether the circuit breaker of a battery allows bus accesses.
+ *
+ * The breaker is closed again, once the cooldown period is over. Each battery
+ * has its own breaker, so that e.g. a detached dock does not keep the main
+ * battery from being sampled.
+ */
+static bool battery_breaker_allows_access(struct battery_instance *battery) {
+    if (!battery->breaker_open)
+        return true;
+    if (time_before(jiffies, battery->breaker_until))
+        return false;
+
+    battery->breaker_open = false;
+    return true;
+}
+
+/** Account the result of a sample for the circuit breaker of a battery */
+static void battery_breaker_account(
+    struct battery_instance *battery,
+    const int result
+) {
+    if (!result) {
+        battery->sample_failures = 0;
+        return;
+    }
+
+    battery->sample_failures++;
+    if (breaker_threshold && battery->sample_failures >= breaker_threshold) {
+        printk_ratelimited(KERN_WARNING "Battery module: %u samples of %s "
+                "failed, suspending bus accesses for %u ms\n",
+                battery->sample_failures, battery->entry->name,
+                breaker_cooldown_ms
+        );
+        battery->breaker_open = true;
+        battery->breaker_until =
+            jiffies + msecs_to_jiffies(breaker_cooldown_ms);
+        battery->sample_failures = 0;
+    }
+}
+
+/**
+ * Update the energy model with a new sample.
+ *
+ * If the energy register was read, the model is re-synchronized to it and the
+ * drift is recorded. Otherwise the smoothed power of the previous snapshot is
+ * integrated over the time since then (using the direction of its status).
+ *
+ * The function returns the modelled energy in mWh.
+ */
+static unsigned int battery_model_energy(
+    struct battery_instance *battery,
+    const struct battery_registers *registers,
+    const unsigned long now
+) {
+    /* the worker is the only writer, so no lock is required to read */
+    const struct battery_snapshot *previous = &battery->snapshot;
+
+    if (registers->fetched & BATTERY_NEEDS(ENERGY)) {
+        const u64 energy =
+            battery_energy(registers->values[BATTERY_FETCH_ENERGY]) * 1000ULL;
+
+        if (previous->valid && !previous->resumed) {
+            battery_stats.energy_resyncs++;
+            battery_stats.energy_drift_mwh = div_u64(
+                energy > battery->energy_model ?
+                    energy - battery->energy_model :
+                    battery->energy_model - energy,
+                1000
+            );
+        }
+        battery->energy_model = energy;
+        battery->energy_synced = now;
+    } else {
+        /* uW * ms = 1/3600000 uWh */
+        const u64 delta = div_u64(
+            (u64)previous->power * jiffies_to_msecs(now - previous->timestamp),
+            3600000
+        );
+
+        if (previous->status == POWER_SUPPLY_STATUS_DISCHARGING)
+            battery->energy_model -= min(delta, battery->energy_model);
+        else if (previous->status == POWER_SUPPLY_STATUS_CHARGING)
+            battery->energy_model = min(
+                battery->energy_model + delta,
+                previous->full_energy * 1000ULL
+            );
+    }
+
+    return div_u64(battery->energy_model, 1000);
+}
+
+/**
+ * Fill a snapshot of a battery with fresh values from the hardware.
+ *
+ * Only the registers in `fetch` are read (the fetch plan, see
+ * `battery_sample_all()`), all other ones keep the values of earlier refreshes.
+ * The energy register is skipped between the re-synchronizations of the
+ * energy model, if the power is fetched, since the energy is modelled from it
+ * then (see `battery_model_energy()`).
+ *
+ * The AC state is taken from the value maintained by the AC adapter monitor, so
+ * it does not cost an additional bus transfer. The smoothed power used for the
+ * time estimations is updated incrementally with every sample of the power.
+ *
+ * The function returns 0 on success or a negative error code. The snapshot is
+ * left untouched on failure. While the circuit breaker is open, no transfer is
+ * issued and -EBUSY is returned.
+ */
+static int battery_refresh(
+    struct battery_instance *battery,
+    const unsigned int fetch,
+    struct battery_snapshot *snapshot
+) {
+    /* the worker is the only writer, so no lock is required to read */
+    const struct battery_snapshot *previous = &battery->snapshot;
+    struct ewma_battery_power *power_avg = &battery->power_avg;
+    struct battery_registers registers = battery->registers;
+    const unsigned long now = jiffies;
+    unsigned int reads = fetch;
+    unsigned int status;
+    unsigned int energy;
+    unsigned int i;
+    bool restart;
+    bool resync;
+    int ret;
+
+    if (!battery_breaker_allows_access(battery))
+        return -EBUSY;
+
+    resync = !previous->valid || previous->resumed || time_after_eq(now,
+        battery->energy_synced + msecs_to_jiffies(energy_resync_ms));
+    if (!resync && (fetch & BATTERY_FETCH_POWER) == BATTERY_FETCH_POWER)
+        reads &= ~BATTERY_NEEDS(ENERGY);
+    registers.fetched = 0;
+
+    /* the device is resumed once for the whole burst of register reads */
+    ret = battery_bus_get(battery->client);
+    if (ret)
+        return ret;
+    ret = battery_read_registers(battery, &registers, reads);
+    battery_bus_put(battery->client);
+    battery_breaker_account(battery, ret);
+    if (ret)
+        return ret;
+    battery->registers = registers;
+
+    energy = battery_model_energy(battery, &registers, now);
+    status = battery_status(registers.values[BATTERY_FETCH_STATUS]);
+    battery_learn_full_energy(battery, &registers, status);
+    restart = status != previous->status || !previous->valid ||
+        previous->resumed;
+    if (restart)
+        ewma_battery_power_init(power_avg);
+
+    *snapshot = *previous;
+    snapshot->energy = energy;
+    snapshot->voltage = registers.values[BATTERY_FETCH_VOLTAGE];
+    snapshot->current_now =
+        battery_current(registers.values[BATTERY_FETCH_RATE]);
+    snapshot->status = status;
+    snapshot->power_now = battery_rate(snapshot);
+    /* a repeated power would distort the average */
+    if (restart || (registers.fetched & BATTERY_FETCH_POWER) ==
+            BATTERY_FETCH_POWER)
+        ewma_battery_power_add(power_avg, snapshot->power_now);
+    snapshot->power = ewma_battery_power_read(power_avg);
+    snapshot->full_energy = READ_ONCE(battery->last_full_energy);
+    snapshot->ac_online = READ_ONCE(ac_adapter_connected);
+    battery_derive_properties(snapshot);
+    snapshot->timestamp = now;
+    snapshot->time_ns = ktime_get_ns();
+    /* the modelled energy is as recent as a fetched one */
+    for (i = 0; i < BATTERY_FETCH_COUNT; i++)
+        if ((fetch | registers.fetched) & BIT(i))
+            snapshot->fetched_at[i] = now;
+    snapshot->valid = true;
+    snapshot->stale = false;
+    snapshot->resumed = false;
+    return 0;
+}
+
+/** Make a snapshot the current one of a battery */
+static void battery_publish_snapshot(
+    struct battery_instance *battery,
+    const struct battery_snapshot *snapshot
+) {
+    write_seqlock(&battery->seqlock);
+    battery->snapshot = *snapshot;
+    write_sequnlock(&battery->seqlock);
+}
+
+/** Copy the current snapshot of a battery (without checking its age) */
+static void battery_copy_snapshot(
+    struct battery_instance *battery,
+    struct battery_snapshot *snapshot
+) {
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&battery->seqlock);
+        *snapshot = battery->snapshot;
+    } while (read_seqretry(&battery->seqlock, seq));
+}
+
+/**
+ * Check, whether the registers in `registers` of a snapshot were fetched within
+ * the last `cache_ttl_ms`.
+ */
+static bool battery_snapshot_fresh(
+    const struct battery_snapshot *snapshot,
+    const unsigned int registers
+) {
+    const unsigned long ttl = msecs_to_jiffies(cache_ttl_ms);
+    unsigned int i;
+
+    if (!snapshot->valid || snapshot->resumed)
+        return false;
+    for (i = 0; i < BATTERY_FETCH_COUNT; i++)
+        if (registers & BIT(i) &&
+                !time_before(jiffies, snapshot->fetched_at[i] + ttl))
+            return false;
+    return true;
+}
+
+/**
+ * Request a refresh of the snapshots by the refresh worker.
+ *
+ * Only the first request is queued until the worker starts, later ones join
+ * it. If `force` is set, the worker samples the hardware even if the snapshot
+ * became fresh in the meantime.
+ *
+ * The function returns true, if the request joined a pending refresh.
+ */
+static bool battery_request_refresh(const bool force) {
+    if (test_bit(BATTERY_REFRESH_STOPPED, &battery_refresh_flags))
+        return false;
+    if (force)
+        set_bit(BATTERY_REFRESH_FORCED, &battery_refresh_flags);
+    if (test_and_set_bit(BATTERY_REFRESH_PENDING, &battery_refresh_flags))
+        return true;
+
+    queue_work(battery_workqueue, &battery_refresh_work);
+    return false;
+}
+
+/**
+ * Set the energy of the full main battery (e.g. restored from an earlier boot).
+ *
+ * The snapshot is refreshed, so that the derived values use the new energy.
+ * While the sampling is not running (before the first sample, during system
+ * sleep or when unloading), the first sample afterwards uses the new energy
+ * instead.
+ */
+static int full_energy_set(const char *value, const struct kernel_param *kp) {
+    unsigned int energy;
+    int ret;
+
+    ret = kstrtouint(value, 0, &energy);
+    if (ret)
+        return ret;
+    if (!energy)
+        return -EINVAL;
+
+    WRITE_ONCE(battery_main->last_full_energy, energy);
+    /* called with the parameter lock held (see `battery_sampling_active`) */
+    if (READ_ONCE(battery_sampling_active))
+        battery_request_refresh(true);
+    return 0;
+}
+
+static const struct kernel_param_ops full_energy_ops = {
+    .set = full_energy_set,
+    .get = param_get_uint
+};
+module_param_cb(full_energy_mwh, &full_energy_ops,
+    &battery_instances[0].last_full_energy, 0644);
+MODULE_PARM_DESC(full_energy_mwh,
+    "Energy in mWh of the full main battery (learned on every full charge)");
+
+/**
+ * Get a copy of the current snapshot of a battery.
+ *
+ * The hardware is never accessed by this function. If the `registers` of the
+ * snapshot are older than `cache_ttl_ms`, a refresh is requested (or joined,
+ * if another query requested one already) and the function waits up to
+ * `refresh_wait_ms` for it. If the refresh takes longer, the expired snapshot
+ * is returned. Thus the latency of the property queries is bounded,
+ * regardless of the state of the bus, and concurrent queries cause a single
+ * refresh.
+ *
+ * The function returns true, if the snapshot was fresh, false if a refresh was
+ * requested.
+ */
+static bool battery_get_snapshot(
+    struct battery_instance *battery,
+    const unsigned int registers,
+    struct battery_snapshot *snapshot
+) {
+    /* read the sequence first, so a concurrent refresh is not missed */
+    const unsigned int seq = atomic_read(&battery_refresh_seq);
+
+    /*
+     * The registers are noted even on a hit (see `battery_fetch_plan()`), but
+     * only written if missing, so hits do not write to a shared cache line.
+     */
+    if ((atomic_read(&battery->requested) & registers) != registers)
+        atomic_or(registers, &battery->requested);
+    smp_rmb();
+    battery_copy_snapshot(battery, snapshot);
+    if (battery_snapshot_fresh(snapshot, registers)) {
+        this_cpu_inc(battery_cache_hits);
+        return true;
+    }
+
+    this_cpu_inc(battery_cache_misses);
+    if (battery_request_refresh(false))
+        this_cpu_inc(battery_cache_coalesced);
+
+    if (refresh_wait_ms && wait_event_timeout(
+            battery_refresh_wait,
+            atomic_read(&battery_refresh_seq) != seq,
+            msecs_to_jiffies(refresh_wait_ms)))
+        battery_copy_snapshot(battery, snapshot);
+    return false;
+}
+
+/** Notify the power supply core (and the tracer) about a changed supply */
+static void battery_supply_changed(struct power_supply *supply) {
+    trace_battery_supply_changed(supply->desc->name);
+    power_supply_changed(supply);
+}
+
+/**
+ * Check, whether consumers should be notified about a new snapshot.
+ *
+ * This is the case, if the status, the capacity (in whole percent) or the level
+ * of capacity changed, or if the first valid snapshot (after loading or
+ * resume) is available.
+ */
+static bool battery_snapshot_changed(
+    const struct battery_snapshot *previous,
+    const struct battery_snapshot *snapshot
+) {
+    if (previous->valid != snapshot->valid ||
+            previous->resumed != snapshot->resumed)
+        return true;
+    if (!snapshot->valid)
+        return false;
+
+    return previous->status != snapshot->status ||
+        previous->capacity != snapshot->capacity ||
+        previous->capacity_level != snapshot->capacity_level;
+}
+
+/**
+ * Allocate the sample history.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int battery_history_create(void) {
+    if (!history_size)
+        return -EINVAL;
+
+    battery_history_bytes = PAGE_ALIGN(
+        PAGE_SIZE + (size_t)history_size * sizeof(*battery_history_samples)
+    );
+    battery_history = vmalloc_user(battery_history_bytes);
+    if (!battery_history)
+        return -ENOMEM;
+
+    battery_history_header = battery_history;
+    battery_history_samples = battery_history + PAGE_SIZE;
+    battery_history_header->magic = BATTERY_HISTORY_MAGIC;
+    battery_history_header->version = BATTERY_HISTORY_VERSION;
+    battery_history_header->size = history_size;
+    battery_history_header->sample_size = sizeof(*battery_history_samples);
+    battery_history_header->data_offset = PAGE_SIZE;
+    battery_history_header->seq = 0;
+    return 0;
+}
+
+/** Release the sample history */
+static void battery_history_destroy(void) {
+    vfree(battery_history);
+    battery_history = NULL;
+}
+
+/**
+ * Append a sample to the history.
+ *
+ * The sample is completely written before the sequence number in the header
+ * is advanced, so that consumers never see partially written samples. `flags`
+ * are added to the flags derived from the snapshot.
+ */
+static void battery_history_push(
+    const struct battery_snapshot *snapshot,
+    const u16 flags
+) {
+    struct battery_history_sample *sample;
+    u64 seq;
+    u64 index;
+
+    if (!battery_history)
+        return;
+
+    seq = battery_history_header->seq;
+    index = seq;
+    sample = &battery_history_samples[do_div(index, history_size)];
+    WRITE_ONCE(sample->seq, seq);
+    smp_wmb();
+    sample->timestamp_ns = snapshot->time_ns;
+    sample->energy = snapshot->energy;
+    sample->voltage = snapshot->voltage;
+    sample->current_now = snapshot->current_now;
+    sample->status = snapshot->status;
+    sample->flags = flags;
+    if (snapshot->ac_online)
+        sample->flags |= BATTERY_SAMPLE_AC_ONLINE;
+    smp_wmb();
+    WRITE_ONCE(battery_history_header->seq, seq + 1);
+}
+
+/**
+ * Take a new snapshot of a battery and publish it.
+ *
+ * Only the registers in `fetch` are read (see `battery_refresh()`). If the
+ * hardware could not be read, the last good snapshot is published again
+ * marked as stale. A change notification of the battery is emitted, if the new
+ * snapshot differs noticeably from the previous one, so that consumers do not
+ * need to poll the battery. The main battery also feeds the sample history
+ * (with complete samples only) and wakes up the readers of the character device
+ * on such changes as well as on changes of the AC state.
+ *
+ * This accesses the hardware and must only be called by the sampling engine
+ * (see `battery_sample_all()`).
+ */
+static void battery_sample(
+    struct battery_instance *battery,
+    const unsigned int fetch,
+    struct battery_snapshot *snapshot
+) {
+    /* the worker is the only writer, so no lock is required to read */
+    const struct battery_snapshot previous = battery->snapshot;
+    bool changed;
+
+    if (battery_refresh(battery, fetch, snapshot)) {
+        *snapshot = previous;
+        snapshot->stale = true;
+    }
+    battery_publish_snapshot(battery, snapshot);
+
+    changed = battery_snapshot_changed(&previous, snapshot);
+    if (changed)
+        battery_supply_changed(battery->supply);
+    if (battery != battery_main)
+        return;
+
+    if (!snapshot->stale && fetch == BATTERY_FETCH_ALL)
+        battery_history_push(snapshot, 0);
+    if (changed || previous.ac_online != snapshot->ac_online) {
+        atomic_inc(&battery_state_generation);
+        wake_up_interruptible(&battery_state_wait);
+    }
+}
+
+/**
+ * Plan the registers to fetch from a battery.
+ *
+ * A refresh of the queries fetches the union of the registers required by the
+ * properties queried since the last refresh and the one before (so the queries
+ * of a burst share a refresh), unless they are still fresh. All registers are
+ * fetched, if `all` is set (the background sampling or a forced refresh) or if
+ * there is no valid snapshot since loading or resume yet.
+ *
+ * The function returns the registers to fetch (0, if nothing has to be done).
+ */
+static unsigned int battery_fetch_plan(
+    const struct battery_instance *battery,
+    const unsigned int requested,
+    const bool all
+) {
+    const unsigned int fetch = requested | battery->interest;
+
+    /* the worker is the only writer, so no lock is required to read */
+    if (all || !battery->snapshot.valid || battery->snapshot.resumed)
+        return BATTERY_FETCH_ALL;
+    if (battery_snapshot_fresh(&battery->snapshot, fetch))
+        return 0;
+    return fetch;
+}
+
+/**
+ * Sample all batteries (the sampling engine).
+ *
+ * The batteries are sampled back to back within a single run of the driver
+ * workqueue, so a refresh costs one wakeup of the bus (see `autosuspend_ms`)
+ * regardless of the number of batteries. Each battery fetches the registers
+ * planned by `battery_fetch_plan()`. Queries waiting for a refresh are woken up
+ * once all snapshots are published.
+ *
+ * While the transaction budget is used up, nothing is sampled and the waiting
+ * queries get the last snapshots. The first snapshots after loading or resume
+ * are always taken, since there is nothing (current) to serve before.
+ *
+ * This accesses the hardware and must only be called by the driver workqueue.
+ */
+static void battery_sample_all(const bool all) {
+    unsigned int requested[BATTERY_MAX_INSTANCES];
+    unsigned int fetch[BATTERY_MAX_INSTANCES];
+    struct battery_instance *battery;
+    struct battery_snapshot snapshot;
+    const ktime_t start = ktime_get();
+    bool sample = false;
+    bool synced = true;
+    unsigned int i;
+    u64 duration;
+
+    for_each_battery(battery) {
+        i = battery - battery_instances;
+        requested[i] = atomic_xchg(&battery->requested, 0);
+        fetch[i] = battery_fetch_plan(battery, requested[i], all);
+        sample |= fetch[i] != 0;
+        synced &= battery->snapshot.valid && !battery->snapshot.resumed;
+    }
+    if (sample && synced && !battery_budget_allows_access()) {
+        /* the next refresh fetches the registers instead */
+        for_each_battery(battery)
+            atomic_or(requested[battery - battery_instances],
+                &battery->requested);
+        sample = false;
+    }
+
+    if (sample) {
+        for_each_battery(battery) {
+            i = battery - battery_instances;
+            battery->interest = requested[i];
+            if (fetch[i])
+                battery_sample(battery, fetch[i], &snapshot);
+        }
+    }
+    atomic_inc(&battery_refresh_seq);
+    wake_up(&battery_refresh_wait);
+    if (!sample)
+        return;
+
+    duration = ktime_to_ns(ktime_sub(ktime_get(), start));
+    battery_stats.refreshes++;
+    battery_stats.refresh_time_ns += duration;
+    if (duration > battery_stats.refresh_max_ns)
+        battery_stats.refresh_max_ns = duration;
+}
+
+/**
+ * Work function refreshing expired snapshots.
+ *
+ * Only the registers required by the queries are fetched (see
+ * `battery_fetch_plan()`). A sample taken in the meantime (e.g. by the
+ * background sampling) satisfies the request as well, unless the refresh was
+ * forced, which fetches all registers of all batteries. The queries waiting for
+ * the refresh are woken up by `battery_sample_all()`.
+ *
+ * The request is taken before anything is sampled, so any request made later
+ * (e.g. after the registers were planned) queues the work once more instead of
+ * joining a refresh, that does not cover it.
+ */
+static void battery_refresh_work_func(struct work_struct *work) {
+    bool force;
+
+    /* a request racing with `battery_stop_refresh()` is dropped */
+    if (test_bit(BATTERY_REFRESH_STOPPED, &battery_refresh_flags))
+        return;
+    clear_bit(BATTERY_REFRESH_PENDING, &battery_refresh_flags);
+    smp_mb__after_atomic();
+    force = test_and_clear_bit(BATTERY_REFRESH_FORCED, &battery_refresh_flags);
+
+    battery_sample_all(force);
+}
+
+/**
+ * Stop the refreshes on behalf of the property queries (before unloading).
+ *
+ * A pending refresh is cancelled, a running one is waited for and later
+ * requests are ignored, so the supplies can be unregistered safely. Queries
+ * still arriving get the last snapshots after waiting for `refresh_wait_ms`.
+ */
+static void battery_stop_refresh(void) {
+    set_bit(BATTERY_REFRESH_STOPPED, &battery_refresh_flags);
+    smp_mb__after_atomic();
+    cancel_work_sync(&battery_refresh_work);
+}
+
+
+/** The description of a property derived from the battery snapshot */
+struct battery_property_desc {
+    /** The registers the value depends on (`BATTERY_NEEDS()` bits) */
+    unsigned int registers;
+    /** The offset of the value inside `struct battery_snapshot` */
+    size_t offset;
+    /** The factor converting the value to the unit of the property */
+    unsigned int scale;
+};
+
+#define BATTERY_PROPERTY(registers, field, scale) { \
+        (registers), \
+        offsetof(struct battery_snapshot, field), \
+        (scale) \
+    }
+
+/**
+ * The properties derived from the battery snapshot (indexed by property).
+ *
+ * The energy is calculated in mWh, but reported in uWh. The average power is
+ * reset with the status (see `ewma_battery_power`), so it depends on it as
+ * well, just like the learned full energy.
+ */
+static const struct battery_property_desc battery_property_table[] = {
+    [POWER_SUPPLY_PROP_STATUS] =
+        BATTERY_PROPERTY(BATTERY_NEEDS(STATUS), status, 1),
+    [POWER_SUPPLY_PROP_CAPACITY] =
+        BATTERY_PROPERTY(BATTERY_NEEDS(ENERGY), capacity, 1),
+    [POWER_SUPPLY_PROP_CAPACITY_LEVEL] = BATTERY_PROPERTY(
+        BATTERY_NEEDS(STATUS) | BATTERY_NEEDS(ENERGY),
+        capacity_level,
+        1
+    ),
+    [POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW] =
+        BATTERY_PROPERTY(BATTERY_FETCH_ALL, time_to_empty, 1),
+    [POWER_SUPPLY_PROP_TIME_TO_FULL_NOW] =
+        BATTERY_PROPERTY(BATTERY_FETCH_ALL, time_to_full, 1),
+    [POWER_SUPPLY_PROP_VOLTAGE_NOW] =
+        BATTERY_PROPERTY(BATTERY_NEEDS(VOLTAGE), voltage, 1),
+    [POWER_SUPPLY_PROP_CURRENT_NOW] =
+        BATTERY_PROPERTY(BATTERY_NEEDS(RATE), current_now, 1),
+    [POWER_SUPPLY_PROP_POWER_NOW] =
+        BATTERY_PROPERTY(BATTERY_FETCH_POWER, power_now, 1),
+    [POWER_SUPPLY_PROP_POWER_AVG] = BATTERY_PROPERTY(
+        BATTERY_NEEDS(STATUS) | BATTERY_FETCH_POWER,
+        power,
+        1
+    ),
+    [POWER_SUPPLY_PROP_ENERGY_FULL] = BATTERY_PROPERTY(
+        BATTERY_NEEDS(STATUS) | BATTERY_NEEDS(ENERGY),
+        full_energy,
+        1000
+    ),
+    [POWER_SUPPLY_PROP_ENERGY_NOW] =
+        BATTERY_PROPERTY(BATTERY_NEEDS(ENERGY), energy, 1000)
+};
+
+/**
+ * Determine the value of a property of a battery.
+ *
+ * Constant properties are answered directly. All other properties are derived
+ * from a battery snapshot (see `battery_get_snapshot()`), so that a burst of
+ * queries (e.g. reading the uevent file) results in a single hardware sample,
+ * which only fetches the registers the queried properties depend on (see
+ * `battery_property_table`).
+ *
+ * `cached` is cleared, if the snapshot was expired and a refresh was triggered.
+ * The query waits at most `refresh_wait_ms` for the refresh and answers with
+ * the last good values otherwise (see `sample_age_ms` and `stale`).
+ *
+ * The function returns 0 (success) on every known property, -ENODATA if no
+ * sample succeeded so far, otherwise the negative value of the "invalid value"
+ * error is returned.
+ */
+static int battery_query_property(
+    struct battery_instance *battery,
+    enum power_supply_property property,
+    union power_supply_propval *val,
+    bool *cached
+) {
+    const struct battery_property_desc *desc;
+    struct battery_snapshot snapshot;
+
+    *cached = true;
+    switch (property) {
+    case POWER_SUPPLY_PROP_ENERGY_FULL_DESIGN:
+        /* always report the last full capacity (we have no designed value) */
+        val->intval = BATTERY_DEFAULT_FULL_ENERGY * 1000;
+        return 0;
+    case POWER_SUPPLY_PROP_ENERGY_EMPTY_DESIGN:
+        /* always report 2.5% of the last full energy */
+        val->intval = BATTERY_DEFAULT_FULL_ENERGY * 25;
+        return 0;
+
+    case POWER_SUPPLY_PROP_PRESENT:
+        val->intval = 1;
+        return 0;
+    case POWER_SUPPLY_PROP_TECHNOLOGY:
+        val->intval = POWER_SUPPLY_TECHNOLOGY_LION;
+        return 0;
+    case POWER_SUPPLY_PROP_MANUFACTURER:
+        val->strval = "Acer";
+        return 0;
+    case POWER_SUPPLY_PROP_MODEL_NAME:
+        val->strval = battery->entry->model;
+        return 0;
+
+    default:
+        break;
+    }
+
+    if (property >= ARRAY_SIZE(battery_property_table))
+        return -EINVAL;
+    desc = &battery_property_table[property];
+    if (!desc->registers)
+        return -EINVAL;
+
+    *cached = battery_get_snapshot(battery, desc->registers, &snapshot);
+    /* never report made-up values (e.g. 0 %), if no sample succeeded yet */
+    if (!snapshot.valid)
+        return -ENODATA;
+    val->intval = *(const unsigned int *)((const u8 *)&snapshot +
+        desc->offset) * desc->scale;
+    return 0;
+}
+
+/**
+ * Query a property from a battery.
+ *
+ * The function is called by the kernel, if any information from the driver is
+ * required (see `battery_query_property()` for details). The battery is the
+ * driver data of the power supply.
+ *
+ * The function returns 0 (success) on every known property, otherwise a
+ * negative error code is returned (negative, since the function is a callback,
+ * that should return a negative number on failure).
+ */
+static int battery_get_property(
+    struct power_supply *supply,
+    enum power_supply_property property,
+    union power_supply_propval *val
+) {
+    struct battery_instance *battery = power_supply_get_drvdata(supply);
+    bool cached;
+    const int ret = battery_query_property(battery, property, val, &cached);
+
+    trace_battery_get_property(property, ret, cached);
+    return ret;
+}
+
+/** Get the battery of the device of a power supply */
+static struct battery_instance *battery_from_device(struct device *dev) {
+    return power_supply_get_drvdata(dev_get_drvdata(dev));
+}
+
+/**
+ * Show the age of the values of a battery in ms.
+ *
+ * This is the time since the last successful sample. Reading it never causes
+ * a refresh.
+ */
+static ssize_t sample_age_ms_show(
+    struct device *dev,
+    struct device_attribute *attr,
+    char *buf
+) {
+    struct battery_snapshot snapshot;
+
+    battery_copy_snapshot(battery_from_device(dev), &snapshot);
+    if (!snapshot.valid)
+        return -ENODATA;
+    return sprintf(buf, "%llu\n",
+        div_u64(ktime_get_ns() - snapshot.time_ns, NSEC_PER_MSEC)
+    );
+}
+static DEVICE_ATTR_RO(sample_age_ms);
+
+/**
+ * Show, whether the values of a battery are stale.
+ *
+ * This is the case, if the latest refresh failed (the values are from an
+ * older one), if none succeeded since the system resumed from sleep or if no
+ * sample succeeded so far. Reading it never causes a
+ * refresh.
+ */
+static ssize_t stale_show(
+    struct device *dev,
+    struct device_attribute *attr,
+    char *buf
+) {
+    struct battery_snapshot snapshot;
+
+    battery_copy_snapshot(battery_from_device(dev), &snapshot);
+    return sprintf(buf, "%d\n", !snapshot.valid || snapshot.stale);
+}
+static DEVICE_ATTR_RO(stale);
+
+/** The additional attributes of the batteries describing the freshness */
+static struct attribute *battery_freshness_attrs[] = {
+    &dev_attr_sample_age_ms.attr,
+    &dev_attr_stale.attr,
+    NULL
+};
+ATTRIBUTE_GROUPS(battery_freshness);
+
+/** Query a property of the AC adapter. */
+static int ac_adapter_get_property(
+    struct power_supply *supply,
+    enum power_supply_property property,
+    union power_supply_propval *val
+) {
+    switch (property) {
+    case POWER_SUPPLY_PROP_ONLINE:
+        val->intval = READ_ONCE(ac_adapter_connected);
+        break;
+
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Read the AC state and notify the power supply core about changes.
+ *
+ * A failed read keeps the last known state, so that it does not show up as a
+ * plug event. So does a read denied by the transaction budget, which only
+ * applies to the periodical poll (@throttle): plug interrupts and the reads
+ * after loading or resume are charged against the budget, but never denied,
+ * since no other read would follow them.
+ */
+static void ac_adapter_update(const bool throttle) {
+    unsigned int online;
+    int ret;
+
+    if (throttle && !battery_budget_allows_access())
+        return;
+    ret = ac_adapter_online(&online);
+    if (ret) {
+        printk_ratelimited(KERN_DEBUG "Battery module: Read of the AC state "
+                "failed (Result: %d)\n", ret
+        );
+        return;
+    }
+
+    if (unlikely(online != ac_adapter_connected)) {
+        WRITE_ONCE(ac_adapter_connected, online);
+        battery_supply_changed(ac_adapter);
+        /* the derived battery values depend on the AC state */
+        battery_request_refresh(true);
+    }
+}
+
+/** Work function for periodical updates of the AC state */
+static void ac_adapter_poll(struct work_struct *work) {
+    battery_stats.ac_poll_wakeups++;
+    ac_adapter_update(true);
+    queue_delayed_work(
+        battery_workqueue,
+        &ac_adapter_work,
+        msecs_to_jiffies(ac_poll_ms)
+    );
+}
+
+/** Interrupt handler (threaded) for AC plug events */
+static irqreturn_t ac_adapter_interrupt(int irq, void *data) {
+    ac_adapter_update(false);
+    return IRQ_HANDLED;
+}
+
+/**
+ * Start monitoring the AC adapter.
+ *
+ * If an interrupt or a GPIO for plug events is configured, the AC state is only
+ * read when it is signalled. Otherwise the state is polled periodically.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static int ac_adapter_start_monitor(void) {
+    unsigned long flags = IRQF_ONESHOT;
+    int ret;
+
+    if (ac_gpio >= 0) {
+        ret = gpio_request_one(ac_gpio, GPIOF_IN, AC_ADAPTER_NAME);
+        if (ret)
+            return ret;
+        ac_adapter_irq = gpio_to_irq(ac_gpio);
+        if (ac_adapter_irq < 0) {
+            ret = ac_adapter_irq;
+            goto gpio_has_no_irq;
+        }
+        flags |= IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING;
+    } else if (ac_irq >= 0) {
+        ac_adapter_irq = ac_irq;
+    } else {
+        queue_delayed_work(
+            battery_workqueue,
+            &ac_adapter_work,
+            msecs_to_jiffies(ac_poll_ms)
+        );
+        return 0;
+    }
+
+    ret = request_threaded_irq(
+        ac_adapter_irq,
+        NULL,
+        ac_adapter_interrupt,
+        flags,
+        AC_ADAPTER_NAME,
+        NULL
+    );
+    if (ret)
+        goto irq_request_failed;
+
+    return 0;
+
+irq_request_failed:
+gpio_has_no_irq:
+    ac_adapter_irq = -1;
+    if (ac_gpio >= 0)
+        gpio_free(ac_gpio);
+    return ret;
+}
+
+/** Stop monitoring the AC adapter */
+static void ac_adapter_stop_monitor(void) {
+    if (ac_adapter_irq >= 0) {
+        free_irq(ac_adapter_irq, NULL);
+        ac_adapter_irq = -1;
+        if (ac_gpio >= 0)
+            gpio_free(ac_gpio);
+    } else {
+        cancel_delayed_work_sync(&ac_adapter_work);
+    }
+}
+
+/** Pause monitoring the AC adapter (during system sleep) */
+static void ac_adapter_park_monitor(void) {
+    if (ac_adapter_irq >= 0)
+        disable_irq(ac_adapter_irq);
+    else
+        cancel_delayed_work_sync(&ac_adapter_work);
+}
+
+/**
+ * Continue monitoring the AC adapter after system sleep.
+ *
+ * The state itself is read by the start work (see `battery_start_work_func()`),
+ * since it may have changed in the meantime.
+ */
+static void ac_adapter_unpark_monitor(void) {
+    if (ac_adapter_irq >= 0)
+        enable_irq(ac_adapter_irq);
+    else
+        queue_delayed_work(
+            battery_workqueue,
+            &ac_adapter_work,
+            msecs_to_jiffies(ac_poll_ms)
+        );
+}
+
+static void battery_sample_work_func(struct work_struct *);
+
+/**
+ * The work that samples the battery in the background.
+ *
+ * Just like the AC polling it is deferrable and runs on the driver workqueue,
+ * so it does not wake up an idle CPU on its own and does not run during system
+ * sleep.
+ */
+static DECLARE_DEFERRABLE_WORK(battery_sample_work, battery_sample_work_func);
+
+/**
+ * Whether the display is switched off.
+ *
+ * The kernel offers no generic notification about the display state, so this
+ * is set from userspace (e.g. by the display power hook of the session). The
+ * background sampling is suspended while it is set.
+ */
+static bool display_off;
+
+/** Restart the background sampling immediately (if it is active) */
+static void battery_sample_kick(void) {
+    if (READ_ONCE(battery_sampling_active))
+        mod_delayed_work(
+            battery_workqueue,
+            &battery_sample_work,
+            0
+        );
+}
+
+/** Set the display state and resume the sampling, if the display is on */
+static int display_off_set(const char *value, const struct kernel_param *kp) {
+    int ret = param_set_bool(value, kp);
+    if (ret)
+        return ret;
+
+    if (!display_off)
+        battery_sample_kick();
+    return 0;
+}
+
+static const struct kernel_param_ops display_off_ops = {
+    .set = display_off_set,
+    .get = param_get_bool
+};
+module_param_cb(display_off, &display_off_ops, &display_off, 0644);
+MODULE_PARM_DESC(display_off,
+    "Set while the display is off to suspend background battery sampling");
+
+/**
+ * Select the interval until the next battery sample in milli seconds.
+ *
+ * Samples are taken quickly while charging or while the rate changes sharply,
+ * since the values change fast then. A stable rate is sampled slowly.
+ */
+static unsigned int battery_sample_interval(
+    const struct battery_snapshot *snapshot,
+    const unsigned int last_rate
+) {
+    const unsigned int rate = battery_rate(snapshot);
+    const unsigned int rate_change = rate > last_rate ?
+        rate - last_rate : last_rate - rate;
+
+    if (snapshot->status == POWER_SUPPLY_STATUS_CHARGING)
+        return sample_fast_ms;
+    /* the rate is in uW */
+    if (rate_change > rate_change_mw * 1000)
+        return sample_fast_ms;
+    return max(sample_slow_ms, sample_fast_ms);
+}
+
+/**
+ * Work function for the background sampling of the batteries.
+ *
+ * All batteries are sampled together and the next sample is scheduled after the
+ * shortest interval required by any of them.
+ */
+static void battery_sample_work_func(struct work_struct *work) {
+    struct battery_instance *battery;
+    unsigned int interval = UINT_MAX;
+
+    if (READ_ONCE(display_off))
+        return;
+
+    battery_sample_all(true);
+    /* the worker is the only writer, so no lock is required to read */
+    for_each_battery(battery) {
+        interval = min(interval, battery_sample_interval(
+            &battery->snapshot,
+            battery->last_rate
+        ));
+        battery->last_rate = battery_rate(&battery->snapshot);
+    }
+
+    queue_delayed_work(
+        battery_workqueue,
+        &battery_sample_work,
+        msecs_to_jiffies(interval)
+    );
+}
+
+/**
+ * The profiling mode.
+ *
+ * While `profile_hz` is set, only the voltage and the rate of the main battery
+ * are read `profile_hz` times per second and appended to the sample history.
+ * A high resolution timer queues the work on the driver workqueue, so the
+ * samples are taken by the only writer of the battery state. Jitter of the
+ * workqueue does not distort the samples, since each one is timestamped right
+ * after the read. Nothing is done while the mode is off. The mode runs along
+ * with the background sampling (see `battery_sampling_active`).
+ */
+static unsigned int profile_hz;
+static struct hrtimer battery_profile_timer;
+static ktime_t battery_profile_period;
+
+/**
+ * Work function taking a profiling sample.
+ *
+ * Only the power registers are read (in a burst, if enabled). The energy and
+ * the status of the sample in the history are taken from the latest regular
+ * sample. The transactions are exempt from the budget, so the regular samples
+ * are not starved while profiling (the rate is limited by
+ * `BATTERY_MAX_PROFILE_HZ` instead).
+ */
+static void battery_profile_work_func(struct work_struct *work) {
+    struct battery_instance *battery = battery_main;
+    struct battery_registers registers = battery->registers;
+    struct battery_snapshot snapshot;
+    int ret;
+
+    /* the worker is the only writer, so no lock is required to read */
+    if (!battery->snapshot.valid || battery->snapshot.resumed ||
+            !battery_breaker_allows_access(battery))
+        return;
+
+    ret = battery_bus_get(battery->client);
+    if (ret)
+        return;
+    registers.fetched = 0;
+    ret = battery_read_registers(battery, &registers, BATTERY_FETCH_POWER);
+    battery_bus_put(battery->client);
+    if (ret)
+        return;
+
+    snapshot = battery->snapshot;
+    snapshot.time_ns = ktime_get_ns();
+    snapshot.voltage = registers.values[BATTERY_FETCH_VOLTAGE];
+    snapshot.current_now =
+        battery_current(registers.values[BATTERY_FETCH_RATE]);
+    battery_history_push(&snapshot, BATTERY_SAMPLE_PROFILE);
+}
+
+/**
+ * Timer callback of the profiling mode.
+ *
+ * If the previous sample is still pending, the current one is dropped.
+ */
+static enum hrtimer_restart battery_profile_timer_func(struct hrtimer *timer) {
+    queue_work(battery_workqueue, &battery_profile_work);
+    hrtimer_forward_now(timer, battery_profile_period);
+    return HRTIMER_RESTART;
+}
+
+/** Start the profiling mode (if it is enabled) */
+static void battery_profile_start(void) {
+    if (!profile_hz)
+        return;
+
+    battery_profile_period = ns_to_ktime(NSEC_PER_SEC / profile_hz);
+    hrtimer_start(
+        &battery_profile_timer,
+        battery_profile_period,
+        HRTIMER_MODE_REL
+    );
+}
+
+/** Stop the profiling mode */
+static void battery_profile_stop(void) {
+    hrtimer_cancel(&battery_profile_timer);
+    cancel_work_sync(&battery_profile_work);
+}
+
+/** Set the rate of the profiling mode and restart it (if it is running) */
+static int profile_hz_set(const char *value, const struct kernel_param *kp) {
+    unsigned int hz;
+    int ret;
+
+    ret = kstrtouint(value, 0, &hz);
+    if (ret)
+        return ret;
+    if (hz > BATTERY_MAX_PROFILE_HZ)
+        return -EINVAL;
+
+    /* called with the parameter lock held (see `battery_sampling_active`) */
+    if (!READ_ONCE(battery_sampling_active)) {
+        profile_hz = hz;
+        return 0;
+    }
+    battery_profile_stop();
+    profile_hz = hz;
+    battery_profile_start();
+    return 0;
+}
+
+static const struct kernel_param_ops profile_hz_ops = {
+    .set = profile_hz_set,
+    .get = param_get_uint
+};
+module_param_cb(profile_hz, &profile_hz_ops, &profile_hz, 0644);
+MODULE_PARM_DESC(profile_hz,
+    "Rate in Hz of the voltage and current profiling (0: off)");
+
+/** Stop the background sampling of the batteries and the profiling mode */
+static void battery_stop_sampling(void) {
+    kernel_param_lock(THIS_MODULE);
+    WRITE_ONCE(battery_sampling_active, false);
+    kernel_param_unlock(THIS_MODULE);
+    battery_profile_stop();
+    cancel_delayed_work_sync(&battery_sample_work);
+}
+
+/**
+ * Invalidate the current snapshots of all batteries.
+ *
+ * The values are still served (marked stale) until the next refresh, but they
+ * are never considered fresh. The next refresh fetches all registers,
+ * re-synchronizes the energy model and restarts the power estimation, and it
+ * notifies the consumers, since the snapshot becomes current again.
+ */
+static void battery_invalidate_snapshots(void) {
+    struct battery_instance *battery;
+
+    for_each_battery(battery) {
+        write_seqlock(&battery->seqlock);
+        battery->snapshot.stale = true;
+        battery->snapshot.resumed = true;
+        write_sequnlock(&battery->seqlock);
+    }
+}
+
+/**
+ * Work function taking the first sample after loading or system sleep, then
+ * starting the background sampling.
+ *
+ * The AC state is read first, since the battery values depend on it. The
+ * sample notifies the consumers, since the snapshot was not current before
+ * (the supplies are registered without data and the snapshot is invalidated on
+ * resume). Afterwards the background sampling continues on its regular
+ * schedule and the profiling mode is started.
+ */
+static void battery_start_work_func(struct work_struct *work) {
+    ac_adapter_update(false);
+    battery_sample_all(true);
+
+    kernel_param_lock(THIS_MODULE);
+    WRITE_ONCE(battery_sampling_active, true);
+    battery_profile_start();
+    kernel_param_unlock(THIS_MODULE);
+    queue_delayed_work(
+        battery_workqueue,
+        &battery_sample_work,
+        msecs_to_jiffies(sample_fast_ms)
+    );
+}
+
+/** The work taking the first sample after loading or system sleep */
+static DECLARE_WORK(battery_start_work, battery_start_work_func);
+
+/** Show the transfer statistics of all registers accessed so far */
+static int battery_debugfs_registers_show(struct seq_file *file, void *data) {
+    unsigned int reg;
+
+    seq_puts(file, "register transfers failures retries\n");
+    for (reg = 0; reg < ARRAY_SIZE(battery_stats.registers); reg++) {
+        const struct battery_register_stats *stats =
+            &battery_stats.registers[reg];
+
+        if (!stats->transfers)
+            continue;
+        seq_printf(file, "0x%02X %llu %llu %llu\n",
+            reg, stats->transfers, stats->failures, stats->retries
+        );
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(battery_debugfs_registers);
+
+/** Show the histogram of the transfer latencies */
+static int battery_debugfs_latency_show(struct seq_file *file, void *data) {
+    unsigned int bucket;
+
+    seq_puts(file, "latency_us transfers\n");
+    seq_printf(file, "<1 %llu\n", battery_stats.latency[0]);
+    for (bucket = 1; bucket < BATTERY_LATENCY_BUCKETS - 1; bucket++)
+        seq_printf(file, "<%lu %llu\n",
+            1UL << bucket, battery_stats.latency[bucket]
+        );
+    seq_printf(file, ">=%lu %llu\n",
+        1UL << (BATTERY_LATENCY_BUCKETS - 2),
+        battery_stats.latency[BATTERY_LATENCY_BUCKETS - 1]
+    );
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(battery_debugfs_latency);
+
+/** Show the number of cache hits and misses of the property queries */
+static int battery_debugfs_cache_show(struct seq_file *file, void *data) {
+    u64 hits = 0;
+    u64 misses = 0;
+    u64 coalesced = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        hits += per_cpu(battery_cache_hits, cpu);
+        misses += per_cpu(battery_cache_misses, cpu);
+        coalesced += per_cpu(battery_cache_coalesced, cpu);
+    }
+    seq_printf(file, "hits %llu\nmisses %llu\ncoalesced %llu\n",
+        hits, misses, coalesced
+    );
+    return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(battery_debugfs_cache);
 
-/** Read the current (dis-)charging rate in mW */
-static inline unsigned int battery_rate(void) {
-    return battery_current() * battery_voltage();
+/**
+ * Create the debugfs directory of the module.
+ *
+ * Errors are ignored, since the statistics are not required for operation.
+ */
+static void battery_debugfs_create(void) {
+    battery_debugfs = debugfs_create_dir("acer-switch-battery", NULL);
+
+    debugfs_create_file("registers", 0444, battery_debugfs, NULL,
+        &battery_debugfs_registers_fops);
+    debugfs_create_file("latency", 0444, battery_debugfs, NULL,
+        &battery_debugfs_latency_fops);
+    debugfs_create_file("cache", 0444, battery_debugfs, NULL,
+        &battery_debugfs_cache_fops);
+    debugfs_create_u64("refreshes", 0444, battery_debugfs,
+        &battery_stats.refreshes);
+    debugfs_create_u64("refresh_time_ns", 0444, battery_debugfs,
+        &battery_stats.refresh_time_ns);
+    debugfs_create_u64("refresh_max_ns", 0444, battery_debugfs,
+        &battery_stats.refresh_max_ns);
+    debugfs_create_u64("ac_poll_wakeups", 0444, battery_debugfs,
+        &battery_stats.ac_poll_wakeups);
+    debugfs_create_u64("energy_resyncs", 0444, battery_debugfs,
+        &battery_stats.energy_resyncs);
+    debugfs_create_u64("energy_drift_mwh", 0444, battery_debugfs,
+        &battery_stats.energy_drift_mwh);
+    debugfs_create_u64("throttled", 0444, battery_debugfs,
+        &battery_stats.throttled);
 }
 
-/** Read the current battery status (charging, discharging, full or unknown) */
-static unsigned int battery_status(void) {
-    const u8 status = read_byte_register(BATTERY_REGISTER_STATUS);
 
-    if (status & 0x01) {
-        return POWER_SUPPLY_STATUS_DISCHARGING;
-    } else if (status & 0x02) {
-        return POWER_SUPPLY_STATUS_CHARGING;
-    } else if ((status & 0x03) == 0x00) {
-        unsigned int energy = battery_energy();
-        /* allow 10% tolerance */
-        if (energy >= 100 * BATTERY_DEFAULT_FULL_ENERGY / 90)
-            battery_last_full_energy = energy;
-        return POWER_SUPPLY_STATUS_FULL;
-    } else {
-        return POWER_SUPPLY_STATUS_UNKNOWN;
-    }
+/**
+ * Map the sample history into userspace.
+ *
+ * Only read-only mappings are allowed, since the buffer is written by the
+ * driver only.
+ */
+static int battery_device_mmap(struct file *file, struct vm_area_struct *vma) {
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    return remap_vmalloc_range(vma, battery_history, vma->vm_pgoff);
 }
 
-/** Read the capacity in % (energy compared to energy if full) */
-static unsigned int battery_capacity(void) {
-    unsigned int last_full = battery_energy_full();
-    if (unlikely(!last_full)) {
-        return 0;
-    } else {
-        unsigned int capacity;
-        /* rounded division */
-        capacity = (100 * battery_energy() + last_full / 2) / last_full;
+/** The state of an opened character device */
+struct battery_device_client {
+    /** The generation of the state returned by the last read */
+    unsigned int generation;
+};
 
-        return unlikely(capacity > 100) ? 100 : capacity;
+/** Open the character device */
+static int battery_device_open(struct inode *inode, struct file *file) {
+    struct battery_device_client *client;
+
+    client = kzalloc(sizeof(*client), GFP_KERNEL);
+    if (!client)
+        return -ENOMEM;
+
+    /* the first read returns immediately */
+    client->generation = atomic_read(&battery_state_generation) - 1;
+    file->private_data = client;
+    return 0;
+}
+
+/** Release the character device */
+static int battery_device_release(struct inode *inode, struct file *file) {
+    kfree(file->private_data);
+    return 0;
+}
+
+/**
+ * Check, whether the state changed since the last read of a client.
+ *
+ * Nothing is reported before the first sample succeeded, so a client never
+ * reads a record without data. The first sample changes the state as well.
+ */
+static bool battery_device_changed(const struct battery_device_client *client) {
+    return READ_ONCE(battery_main->snapshot.valid) &&
+        atomic_read(&battery_state_generation) != client->generation;
+}
+
+/**
+ * Read the current state as a binary record.
+ *
+ * The function blocks until the state changed since the last read, unless the
+ * file was opened non-blocking. The buffer has to be large enough for a whole
+ * record.
+ */
+static ssize_t battery_device_read(
+    struct file *file,
+    char __user *buffer,
+    size_t count,
+    loff_t *offset
+) {
+    struct battery_device_client *client = file->private_data;
+    struct battery_state_record record = {};
+    struct battery_snapshot snapshot;
+    unsigned int generation;
+    int ret;
+
+    if (count < sizeof(record))
+        return -EINVAL;
+
+    if (!battery_device_changed(client)) {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(
+            battery_state_wait,
+            battery_device_changed(client)
+        );
+        if (ret)
+            return ret;
     }
+
+    /* read the generation first, so a concurrent change is not missed */
+    generation = atomic_read(&battery_state_generation);
+    smp_rmb();
+    battery_copy_snapshot(battery_main, &snapshot);
+
+    record.generation = generation;
+    record.timestamp_ns = snapshot.time_ns;
+    record.energy = snapshot.energy;
+    record.full_energy = snapshot.full_energy;
+    record.voltage = snapshot.voltage;
+    record.current_now = snapshot.current_now;
+    record.power = snapshot.power;
+    record.time_to_empty = snapshot.time_to_empty;
+    record.time_to_full = snapshot.time_to_full;
+    record.status = snapshot.status;
+    record.capacity = snapshot.capacity;
+    record.capacity_level = snapshot.capacity_level;
+    if (snapshot.ac_online)
+        record.flags |= BATTERY_SAMPLE_AC_ONLINE;
+    if (snapshot.stale)
+        record.flags |= BATTERY_SAMPLE_STALE;
+
+    if (copy_to_user(buffer, &record, sizeof(record)))
+        return -EFAULT;
+
+    client->generation = generation;
+    return sizeof(record);
 }
 
-/** Read the level of capacity. Calculation based on fixed thresholds */
-static unsigned int battery_capaity_level(void) {
-    if (battery_status() == POWER_SUPPLY_STATUS_FULL) {
-        return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
-    } else {
-        const unsigned int capacity = battery_capacity();
-        if (capacity >= 99)
-            return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
-        else if (capacity <= 5)
-            return POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
-        else if (capacity <= 15)
-            return POWER_SUPPLY_CAPACITY_LEVEL_LOW;
-        else
-            return POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+/** Wait for a change of the state */
+static __poll_t battery_device_poll(
+    struct file *file,
+    struct poll_table_struct *wait
+) {
+    struct battery_device_client *client = file->private_data;
+
+    poll_wait(file, &battery_state_wait, wait);
+    return battery_device_changed(client) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/** The file operations of the character device */
+static const struct file_operations battery_device_fops = {
+    .owner = THIS_MODULE,
+    .open = battery_device_open,
+    .release = battery_device_release,
+    .read = battery_device_read,
+    .poll = battery_device_poll,
+    .mmap = battery_device_mmap,
+    .llseek = no_llseek
+};
+
+/** The character device giving access to the state and the sample history */
+static struct miscdevice battery_miscdevice = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "acer-switch-battery",
+    .fops = &battery_device_fops,
+    .mode = 0444
+};
+
+
+/**
+ * Bind an I2C device of the battery or the AC adapter.
+ *
+ * The runtime PM of the device is enabled with autosuspend, so that the bus
+ * controller is only powered during the accesses (see `battery_bus_get()`).
+ * The device starts suspended.
+ */
+static int battery_i2c_probe(
+    struct i2c_client *client,
+    const struct i2c_device_id *id
+) {
+    pm_runtime_set_autosuspend_delay(&client->dev, autosuspend_ms);
+    pm_runtime_use_autosuspend(&client->dev);
+    pm_runtime_set_suspended(&client->dev);
+    pm_runtime_enable(&client->dev);
+    return 0;
+}
+
+/**
+ * Unbind an I2C device of the battery or the AC adapter.
+ *
+ * A device still waiting for its autosuspend releases the bus controller.
+ */
+static int battery_i2c_remove(struct i2c_client *client) {
+    pm_runtime_disable(&client->dev);
+    pm_runtime_dont_use_autosuspend(&client->dev);
+    if (!pm_runtime_status_suspended(&client->dev))
+        battery_runtime_suspend(&client->dev);
+    pm_runtime_set_suspended(&client->dev);
+    return 0;
+}
+
+/** Get the bus controller of an I2C device (the parent of its adapter) */
+static struct device *battery_bus_controller(struct device *dev) {
+    return to_i2c_client(dev)->adapter->dev.parent;
+}
+
+/**
+ * Suspend or resume an I2C device.
+ *
+ * The EC itself requires no handling. The I2C core does not resume the bus
+ * controller along with its devices (the adapter ignores its children), so an
+ * active device holds a runtime PM reference of the controller. Thus the
+ * accesses within `autosuspend_ms` share a single wakeup of the controller.
+ */
+static int battery_runtime_suspend(struct device *dev) {
+    struct device *controller = battery_bus_controller(dev);
+
+    if (controller) {
+        pm_runtime_mark_last_busy(controller);
+        pm_runtime_put_autosuspend(controller);
     }
+    return 0;
 }
 
-/** Read the estimated time until the battery is empty */
-static unsigned int battery_time_to_empty(void) {
-    unsigned int rate = battery_rate();
-    if (unlikely(!rate))
+static int battery_runtime_resume(struct device *dev) {
+    struct device *controller = battery_bus_controller(dev);
+    int ret;
+
+    if (!controller)
         return 0;
-    return battery_energy() * 60ULL * 60ULL * 1000ULL / rate;
+
+    ret = pm_runtime_get_sync(controller);
+    if (ret < 0) {
+        pm_runtime_put_noidle(controller);
+        return ret;
+    }
+    return 0;
 }
 
-/** Read the state of the AC plug */
-static inline unsigned int ac_adapter_online(void) {
-    u8 data = i2c_smbus_read_byte_data(ac_adapter_device, AC_ADAPTER_REGISTER);
+/**
+ * Prepare for system sleep.
+ *
+ * The background sampling, the AC monitoring and pending refreshes are parked,
+ * so that no bus access is issued while the system sleeps. This is done once,
+ * when the device of the main battery is suspended.
+ */
+static int battery_suspend(struct device *dev) {
+    if (to_i2c_client(dev) != battery_main->client)
+        return 0;
 
-    return data & 0x10 ? 1 : 0;
+    /* the start work would restart the sampling */
+    cancel_work_sync(&battery_start_work);
+    battery_stop_sampling();
+    ac_adapter_park_monitor();
+    cancel_work_sync(&battery_refresh_work);
+    /* a cancelled refresh must not block later requests */
+    clear_bit(BATTERY_REFRESH_PENDING, &battery_refresh_flags);
+    return 0;
 }
 
-/** Read the estimated time until the battery is fully charged */
-static unsigned int battery_time_to_full(void) {
-    int energy_missing;
-    unsigned int rate;
-    if (!ac_adapter_online())
+/**
+ * Continue after system sleep.
+ *
+ * The snapshots taken before the sleep are outdated, so they are invalidated.
+ * The first sample is only queued (see `battery_start_work_func()`), so that
+ * the resume does not wait for the EC.
+ */
+static int battery_resume(struct device *dev) {
+    if (to_i2c_client(dev) != battery_main->client)
         return 0;
 
-    rate = battery_rate();
-    if (unlikely(!rate))
+    battery_invalidate_snapshots();
+    ac_adapter_unpark_monitor();
+    queue_work(battery_workqueue, &battery_start_work);
+    return 0;
+}
+
+/**
+ * Select the cheapest transfers supported by the adapter.
+ *
+ * Plain I2C adapters allow combined and burst reads. Adapters, that only
+ * support SMBus, are used with the separate byte reads (see
+ * `battery_smbus_transfer()`). The AC adapter is always read using SMBus.
+ *
+ * The function returns 0 on success or -ENODEV, if the adapter supports none
+ * of these.
+ */
+static __init int battery_select_transfers(struct i2c_adapter *adapter) {
+    const u32 smbus = I2C_FUNC_SMBUS_WRITE_I2C_BLOCK | I2C_FUNC_SMBUS_READ_BYTE;
+
+    if (!i2c_check_functionality(adapter, I2C_FUNC_SMBUS_READ_BYTE_DATA)) {
+        printk(KERN_ERR "Battery module: The adapter does not support byte "
+                "reads\n");
+        return -ENODEV;
+    }
+    if (i2c_check_functionality(adapter, I2C_FUNC_I2C))
         return 0;
+    if (!i2c_check_functionality(adapter, smbus)) {
+        printk(KERN_ERR "Battery module: The adapter does not support the "
+                "register access command\n");
+        return -ENODEV;
+    }
 
-    energy_missing = battery_energy_full() - battery_energy();
-    if (unlikely(energy_missing) < 0)
-        energy_missing = 0;
+    printk(KERN_INFO "Battery module: The adapter only supports SMBus, "
+            "reading registers byte by byte\n");
+    WRITE_ONCE(battery_smbus_only, true);
+    combined_reads = false;
+    burst_reads = false;
+    return 0;
+}
 
-    return energy_missing * 60ULL * 60ULL * 1000ULL / rate;
+/**
+ * Create an I2C device on the bus of the EC.
+ *
+ * The function returns the device or NULL on failure.
+ */
+static __init struct i2c_client *battery_new_device(
+    struct i2c_adapter *i2c_bus,
+    const char *type,
+    const unsigned short address
+) {
+    struct i2c_board_info info = {};
+
+    strscpy(info.type, type, sizeof(info.type));
+    info.addr = address;
+    return i2c_new_device(i2c_bus, &info);
+}
+
+/** Set up the batteries present (see `battery_table`) */
+static __init void battery_create_instances(void) {
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(battery_table); i++) {
+        struct battery_instance *battery =
+            &battery_instances[battery_instance_count];
+
+        /* the main battery is always present, even if emulated */
+        if (i && !*battery_table[i].address)
+            continue;
+
+        battery->entry = &battery_table[i];
+        battery->description = battery_description;
+        battery->description.name = battery_table[i].name;
+        seqlock_init(&battery->seqlock);
+        battery_instance_count++;
+    }
 }
 
+/** Remove the I2C devices of the batteries created so far */
+static void battery_remove_battery_devices(void) {
+    struct battery_instance *battery;
+
+    for_each_battery(battery) {
+        if (!battery->client)
+            break;
+        i2c_unregister_device(battery->client);
+        battery->client = NULL;
+    }
+}
 
 /**
- * Query a property from the battery.
- *
- * The function is called by the kernel, if any information from the driver is
- * required.
+ * Create the I2C devices of the batteries and the AC adapter.
  *
- * The function is currently designed in a way, that the "battery information"
- * (see ACPI documentation) is read at every call to this function. The relevant
- * data is the used inside the function.
+ * The driver is registered first, so that the devices are bound as soon as they
+ * are created. The adapter is only referenced while the devices are created,
+ * the devices keep it alive afterwards. Nothing is created, if the EC is
+ * emulated.
  *
- * The function returns 0 (success) on every known property, otherwise the
- * negative value of the "invalid value" error is returned (negative, since the
- * function is a callback, that should return a negative number on failure).
+ * The function returns 0 on success or a negative error code.
  */
-static int battery_get_property(
-    struct power_supply *supply,
-    enum power_supply_property property,
-    union power_supply_propval *val
-) {
-    switch (property) {
-    case POWER_SUPPLY_PROP_CAPACITY:
-        val->intval = battery_capacity();
-        break;
-    case POWER_SUPPLY_PROP_STATUS:
-        val->intval = battery_status();
-        break;
-    case POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW:
-        val->intval = battery_time_to_empty();
-        break;
-    case POWER_SUPPLY_PROP_TIME_TO_FULL_NOW:
-        val->intval = battery_time_to_full();
-        break;
-    case POWER_SUPPLY_PROP_VOLTAGE_NOW:
-        val->intval = battery_voltage();
-        break;
-    case POWER_SUPPLY_PROP_CURRENT_NOW:
-        val->intval = battery_current();
-        break;
-    case POWER_SUPPLY_PROP_ENERGY_FULL:
-        /* we calculate in mW, but the value is assumed to be in uW */
-        val->intval = battery_energy_full() * 1000;
-        break;
-    case POWER_SUPPLY_PROP_ENERGY_NOW:
-        /* we calculate in mW, but the value is assumed to be in uW */
-        val->intval = battery_energy() * 1000;
-        break;
-    case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
-        val->intval = battery_capaity_level();
-        break;
-    case POWER_SUPPLY_PROP_ENERGY_FULL_DESIGN:
-        /* always report the last full capacity (we have no designed value) */
-        val->intval = BATTERY_DEFAULT_FULL_ENERGY * 1000;
-        break;
-    case POWER_SUPPLY_PROP_ENERGY_EMPTY_DESIGN:
-        /* always report 2.5% of the last full energy */
-        val->intval = BATTERY_DEFAULT_FULL_ENERGY * 25;
-        break;
+static __init int battery_create_devices(void) {
+    struct battery_instance *battery;
+    struct i2c_adapter *i2c_bus;
+    int ret;
 
-    case POWER_SUPPLY_PROP_PRESENT:
-        val->intval = 1;
-        break;
-    case POWER_SUPPLY_PROP_TECHNOLOGY:
-        val->intval = POWER_SUPPLY_TECHNOLOGY_LION;
-        break;
-    case POWER_SUPPLY_PROP_MANUFACTURER:
-        val->strval = "Acer";
-        break;
-    case POWER_SUPPLY_PROP_MODEL_NAME:
-        val->strval = "Acer Switch 11 Battery by jfrimmel";
-        break;
+    battery_create_instances();
+    if (emulate)
+        return 0;
 
-    default:
-        return -EINVAL;
+    ret = i2c_add_driver(&battery_i2c_driver);
+    if (ret)
+        return ret;
+
+    ret = -ENODEV;
+    i2c_bus = i2c_get_adapter(i2c_bus_nr);
+    if (!i2c_bus) goto i2c_bus_adapter_not_available;
+
+    ret = battery_select_transfers(i2c_bus);
+    if (ret) goto adapter_not_supported;
+    ret = -ENODEV;
+
+    for_each_battery(battery) {
+        battery->client = battery_new_device(
+            i2c_bus,
+            "acer-switch-battery",
+            *battery->entry->address
+        );
+        if (!battery->client) goto battery_device_creation_failed;
     }
+
+    ac_adapter_device =
+        battery_new_device(i2c_bus, "acer-switch-AC", ac_address);
+    if (!ac_adapter_device) goto ac_adapter_device_creation_failed;
+
+    i2c_put_adapter(i2c_bus);
     return 0;
+
+ac_adapter_device_creation_failed:
+battery_device_creation_failed:
+    battery_remove_battery_devices();
+adapter_not_supported:
+    i2c_put_adapter(i2c_bus);
+i2c_bus_adapter_not_available:
+    i2c_del_driver(&battery_i2c_driver);
+    return ret;
 }
 
-/** Query a property of the AC adapter. */
-static int ac_adapter_get_property(
-    struct power_supply *supply,
-    enum power_supply_property property,
-    union power_supply_propval *val
-) {
-    switch (property) {
-    case POWER_SUPPLY_PROP_ONLINE:
-        val->intval = ac_adapter_connected;
-        break;
+/** Remove the I2C devices of the batteries and the AC adapter */
+static void battery_remove_devices(void) {
+    if (emulate)
+        return;
 
-    default:
-        return -EINVAL;
+    i2c_unregister_device(ac_adapter_device);
+    battery_remove_battery_devices();
+    i2c_del_driver(&battery_i2c_driver);
+}
+
+
+/** Destroy the register maps of the batteries */
+static void battery_regmap_destroy(void) {
+    struct battery_instance *battery;
+
+    for_each_battery(battery) {
+        if (!battery->regmap)
+            break;
+        regmap_exit(battery->regmap);
+        battery->regmap = NULL;
+    }
+}
+
+/**
+ * Create the register maps of the batteries.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static __init int battery_regmap_create(void) {
+    struct battery_instance *battery;
+    int ret;
+
+    for_each_battery(battery) {
+        battery->regmap = regmap_init(
+            emulate ? NULL : &battery->client->dev,
+            &battery_regmap_bus,
+            battery,
+            &battery_regmap_config
+        );
+        ret = PTR_ERR_OR_ZERO(battery->regmap);
+        if (ret) {
+            battery->regmap = NULL;
+            goto regmap_init_failed;
+        }
     }
     return 0;
+
+regmap_init_failed:
+    battery_regmap_destroy();
+    return ret;
+}
+
+
+/** Unregister the power supplies of the batteries */
+static void battery_unregister_supplies(void) {
+    struct battery_instance *battery;
+
+    for_each_battery(battery) {
+        if (!battery->supply)
+            break;
+        power_supply_unregister(battery->supply);
+        battery->supply = NULL;
+    }
 }
 
-/** Kernel thread for periodical updates of the AC state */
-static int ac_adapter_updater(void *params) {
-    unsigned int last_state = -1;
-    while (!kthread_should_stop()) {
-        ac_adapter_connected = ac_adapter_online();
-        if (unlikely(ac_adapter_connected != last_state))
-            power_supply_changed(ac_adapter);
-        last_state = ac_adapter_connected;
+/**
+ * Register the power supplies of the batteries.
+ *
+ * Each supply gets its battery as driver data (see `battery_get_property()`)
+ * and the attributes describing the freshness of its values.
+ *
+ * The function returns 0 on success or a negative error code.
+ */
+static __init int battery_register_supplies(void) {
+    struct battery_instance *battery;
+    int ret;
+
+    for_each_battery(battery) {
+        struct power_supply_config config = {
+            .drv_data = battery,
+            .attr_grp = battery_freshness_groups
+        };
 
-        msleep_interruptible(AC_ADAPTER_CHECK_RATE_MS);
+        battery->supply = power_supply_register(
+            emulate ? NULL : &battery->client->dev,
+            &battery->description,
+            &config
+        );
+        ret = PTR_ERR_OR_ZERO(battery->supply);
+        if (ret) {
+            battery->supply = NULL;
+            goto supply_registration_failed;
+        }
     }
     return 0;
+
+supply_registration_failed:
+    battery_unregister_supplies();
+    return ret;
 }
 
 
+
 /**
  * Initialize the kernel module.
  *
  * This function is called, if the module is loaded/inserted into the kernel.
- * It acquires or registers resources, such as an I2C slave (the battery) or the
- * power supply.
+ * It acquires or registers resources, such as the I2C slaves (the batteries) or
+ * the power supplies.
+ *
+ * The EC is not accessed here, so loading the module never waits for it. The
+ * supplies are registered without data (their status is unknown) and the first
+ * sample is taken by the driver workqueue (see `battery_start_work_func()`),
+ * which notifies the consumers once the data is available.
  *
- * The function returns 0 on success, -1 otherwise. Resources acquired during
- * the initialization phase are released in the case of an error.
+ * The function returns 0 on success or a negative error code. Resources
+ * acquired during the initialization phase are released in the case of an
+ * error.
  */
 static __init int battery_module_init(void) {
-    i2c_bus = i2c_get_adapter(I2C_BUS);
-    if (!i2c_bus) goto i2c_bus_adapter_not_available;
-
-    battery_device = i2c_new_device(i2c_bus, battery_info);
-    if (!battery_device) goto battery_device_creation_failed;
+    int ret = -ENOMEM;
 
-    ac_adapter_device = i2c_new_device(i2c_bus, ac_adapter_info);
-    if (!ac_adapter_device) goto ac_adapter_device_creation_failed;
+    battery_budget_reset();
+    hrtimer_init(&battery_profile_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    battery_profile_timer.function = battery_profile_timer_func;
 
-    battery = power_supply_register(
-        NULL,
-        &battery_description,
-        &battery_config
+    battery_workqueue = alloc_ordered_workqueue(
+        "acer-switch-battery",
+        WQ_FREEZABLE
     );
-    if (!battery) goto battery_registration_failure;
+    if (!battery_workqueue) goto workqueue_creation_failed;
+
+    ret = battery_history_create();
+    if (ret) goto history_creation_failed;
+
+    ret = battery_create_devices();
+    if (ret) goto device_creation_failed;
+
+    ret = battery_regmap_create();
+    if (ret) goto regmap_creation_failed;
+
+    ret = battery_register_supplies();
+    if (ret) goto battery_registration_failure;
 
     ac_adapter = power_supply_register(
-        NULL,
+        emulate ? NULL : &ac_adapter_device->dev,
         &ac_adapter_description,
         &ac_adapter_config
     );
-    if (!ac_adapter) goto ac_adapter_registration_failure;
+    ret = PTR_ERR_OR_ZERO(ac_adapter);
+    if (ret) goto ac_adapter_registration_failure;
+
+    ret = ac_adapter_start_monitor();
+    if (ret) goto ac_adapter_monitor_failed;
 
-    ac_adapter_thread = kthread_run(ac_adapter_updater, NULL, "AC update");
-    if (!ac_adapter_thread) goto thread_creation_failed;
+    ret = misc_register(&battery_miscdevice);
+    if (ret) goto device_registration_failed;
+
+    battery_debugfs_create();
+    queue_work(battery_workqueue, &battery_start_work);
 
     return 0;
 
-thread_creation_failed:
+device_registration_failed:
+    ac_adapter_stop_monitor();
+ac_adapter_monitor_failed:
     power_supply_unregister(ac_adapter);
 ac_adapter_registration_failure:
-    power_supply_unregister(battery);
+    /* queries may have requested a refresh since the supplies exist */
+    battery_stop_refresh();
+    battery_unregister_supplies();
 battery_registration_failure:
-    i2c_unregister_device(ac_adapter_device);
-ac_adapter_device_creation_failed:
-    i2c_unregister_device(battery_device);
-battery_device_creation_failed:
-    i2c_put_adapter(i2c_bus);
-i2c_bus_adapter_not_available:
-    return -1;
+    battery_regmap_destroy();
+regmap_creation_failed:
+    battery_remove_devices();
+device_creation_failed:
+    battery_history_destroy();
+history_creation_failed:
+    destroy_workqueue(battery_workqueue);
+workqueue_creation_failed:
+    return ret;
 }
 
 /**
@@ -525,12 +3772,20 @@ i2c_bus_adapter_not_available:
  * resources.
  */
 static __exit void battery_module_exit(void) {
-    kthread_stop(ac_adapter_thread);
+    /* the start work would restart the sampling */
+    cancel_work_sync(&battery_start_work);
+    battery_stop_sampling();
+    debugfs_remove_recursive(battery_debugfs);
+    misc_deregister(&battery_miscdevice);
+    ac_adapter_stop_monitor();
+    /* the last AC poll may have requested a refresh */
+    battery_stop_refresh();
     power_supply_unregister(ac_adapter);
-    power_supply_unregister(battery);
-    i2c_unregister_device(ac_adapter_device);
-    i2c_unregister_device(battery_device);
-    i2c_put_adapter(i2c_bus);
+    battery_unregister_supplies();
+    destroy_workqueue(battery_workqueue);
+    battery_regmap_destroy();
+    battery_remove_devices();
+    battery_history_destroy();
 }
 
 
@@ -0,0 +1,291 @@
+/**
+ * Benchmark harness for the battery driver of the Acer Switch 11 laptop.
+ *
+ * A number of threads concurrently read sysfs attributes of the battery (each
+ * read opens, reads and closes the file, just like typical pollers do). After
+ * the run the latency percentiles of the reads, the I2C transactions per second
+ * (from the debugfs statistics of the module), the CPU time per read and the
+ * run time of the refresh worker per hardware sample are reported.
+ *
+ * Usage: battery-bench [-n readers] [-t seconds] [-d debugfs dir] file...
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/** The default debugfs directory of the module */
+#define DEFAULT_DEBUGFS "/sys/kernel/debug/acer-switch-battery"
+
+/** The state of a single reader thread */
+struct reader {
+    pthread_t thread;
+    /** The files read in turn */
+    char **files;
+    int num_files;
+    /** The latencies of all reads in ns */
+    uint64_t *latencies;
+    size_t count;
+    size_t capacity;
+    /** The number of failed reads */
+    size_t errors;
+};
+
+/** Set, once the readers should stop */
+static volatile int stop;
+
+/** Get the current time of the monotonic clock in ns */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Get the CPU time (user and system) used by the process in ns */
+static uint64_t cpu_time_ns(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+/** Read a whole file once. Returns 0 on success, -1 otherwise. */
+static int read_file(const char *path) {
+    char buffer[4096];
+    ssize_t ret;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    do {
+        ret = read(fd, buffer, sizeof(buffer));
+    } while (ret > 0);
+    close(fd);
+
+    return ret < 0 ? -1 : 0;
+}
+
+/** Record the latency of a read */
+static void record(struct reader *reader, const uint64_t latency) {
+    if (reader->count == reader->capacity) {
+        reader->capacity = reader->capacity ? 2 * reader->capacity : 4096;
+        reader->latencies = realloc(
+            reader->latencies,
+            reader->capacity * sizeof(*reader->latencies)
+        );
+        if (!reader->latencies) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    reader->latencies[reader->count++] = latency;
+}
+
+/** The thread function of a reader */
+static void *reader_main(void *param) {
+    struct reader *reader = param;
+    int file = 0;
+
+    while (!stop) {
+        const uint64_t start = now_ns();
+
+        if (read_file(reader->files[file]))
+            reader->errors++;
+        else
+            record(reader, now_ns() - start);
+        file = (file + 1) % reader->num_files;
+    }
+    return NULL;
+}
+
+/**
+ * Sum up the transfers of all registers in the debugfs statistics.
+ *
+ * Returns -1, if the statistics are not available.
+ */
+static long long read_transfers(const char *debugfs) {
+    char path[512];
+    char line[256];
+    long long total = 0;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/registers", debugfs);
+    file = fopen(path, "r");
+    if (!file)
+        return -1;
+    /* skip the header */
+    if (!fgets(line, sizeof(line), file)) {
+        fclose(file);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        unsigned int reg;
+        long long transfers;
+
+        if (sscanf(line, "%x %lld", &reg, &transfers) == 2)
+            total += transfers;
+    }
+    fclose(file);
+    return total;
+}
+
+/** Read a single number from a debugfs file (-1, if not available) */
+static long long read_counter(const char *debugfs, const char *name) {
+    char path[512];
+    long long value = -1;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/%s", debugfs, name);
+    file = fopen(path, "r");
+    if (!file)
+        return -1;
+    if (fscanf(file, "%lld", &value) != 1)
+        value = -1;
+    fclose(file);
+    return value;
+}
+
+/** Compare two latencies (for qsort) */
+static int compare(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/** Print the usage of the program */
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-n readers] [-t seconds] [-d debugfs dir] file...\n",
+        name
+    );
+}
+
+int main(int argc, char **argv) {
+    const char *debugfs = DEFAULT_DEBUGFS;
+    unsigned int seconds = 10;
+    int num_readers = 4;
+    struct reader *readers;
+    long long transfers_before, transfers_after;
+    long long refreshes_before, refreshes_after;
+    long long refresh_ns_before, refresh_ns_after;
+    uint64_t start, duration, cpu_start, cpu;
+    uint64_t *latencies;
+    size_t count = 0;
+    size_t errors = 0;
+    int option;
+    int i;
+
+    while ((option = getopt(argc, argv, "n:t:d:h")) != -1) {
+        switch (option) {
+        case 'n':
+            num_readers = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'd':
+            debugfs = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || num_readers <= 0 || !seconds) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    readers = calloc(num_readers, sizeof(*readers));
+    if (!readers) {
+        perror("calloc");
+        return 1;
+    }
+
+    transfers_before = read_transfers(debugfs);
+    refreshes_before = read_counter(debugfs, "refreshes");
+    refresh_ns_before = read_counter(debugfs, "refresh_time_ns");
+    cpu_start = cpu_time_ns();
+    start = now_ns();
+
+    for (i = 0; i < num_readers; i++) {
+        readers[i].files = &argv[optind];
+        readers[i].num_files = argc - optind;
+        if (pthread_create(&readers[i].thread, NULL, reader_main, &readers[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < num_readers; i++) {
+        pthread_join(readers[i].thread, NULL);
+        count += readers[i].count;
+        errors += readers[i].errors;
+    }
+
+    duration = now_ns() - start;
+    cpu = cpu_time_ns() - cpu_start;
+    transfers_after = read_transfers(debugfs);
+    refreshes_after = read_counter(debugfs, "refreshes");
+    refresh_ns_after = read_counter(debugfs, "refresh_time_ns");
+
+    if (!count) {
+        fprintf(stderr, "No successful reads (%zu errors)\n", errors);
+        return 1;
+    }
+    latencies = malloc(count * sizeof(*latencies));
+    if (!latencies) {
+        perror("malloc");
+        return 1;
+    }
+    count = 0;
+    for (i = 0; i < num_readers; i++) {
+        memcpy(&latencies[count], readers[i].latencies,
+            readers[i].count * sizeof(*latencies));
+        count += readers[i].count;
+        free(readers[i].latencies);
+    }
+    qsort(latencies, count, sizeof(*latencies), compare);
+
+    printf("readers %d\n", num_readers);
+    printf("reads %zu\n", count);
+    printf("errors %zu\n", errors);
+    printf("reads_per_s %.1f\n", count * 1e9 / duration);
+    printf("latency_p50_us %.1f\n", latencies[count / 2] / 1e3);
+    printf("latency_p99_us %.1f\n", latencies[count * 99 / 100] / 1e3);
+    printf("latency_max_us %.1f\n", latencies[count - 1] / 1e3);
+    printf("cpu_per_read_us %.2f\n", cpu / 1e3 / count);
+    if (transfers_before >= 0 && transfers_after >= 0)
+        printf("i2c_transfers_per_s %.1f\n",
+            (transfers_after - transfers_before) * 1e9 / duration);
+    if (refreshes_before >= 0 && refreshes_after > refreshes_before &&
+            refresh_ns_before >= 0 && refresh_ns_after >= 0)
+        printf("worker_time_per_sample_us %.1f\n",
+            (refresh_ns_after - refresh_ns_before) / 1e3 /
+            (refreshes_after - refreshes_before));
+
+    free(latencies);
+    free(readers);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0
+#
+# Benchmark of the battery driver using the emulated EC.
+#
+# The module is loaded in the per-register, the burst and the cached mode one
+# after another. For each mode the benchmark harness reads the uevent file and
+# the single attributes of the battery with several concurrent readers and
+# reports the read latency, the bus transactions and the CPU time.
+#
+# Usage: run-bench.sh [readers] [seconds]
+#
+# The exit codes follow the kselftest conventions.
+
+KSFT_PASS=0
+KSFT_FAIL=1
+KSFT_SKIP=4
+
+readers=${1:-4}
+seconds=${2:-10}
+
+dir=$(dirname "$0")
+module="$dir/../battery-module.ko"
+harness="$dir/battery-bench"
+supply=/sys/class/power_supply/BAT0
+debugfs=/sys/kernel/debug/acer-switch-battery
+
+skip() {
+    echo "SKIP: $1"
+    exit $KSFT_SKIP
+}
+
+[ "$(id -u)" -eq 0 ] || skip "must be run as root"
+[ -f "$module" ] || skip "module not built (run make)"
+[ -x "$harness" ] || skip "harness not built (run make bench)"
+[ -d /sys/kernel/debug ] || skip "debugfs is not available"
+grep -q '^battery_module ' /proc/modules && skip "module is already loaded"
+
+# run_mode NAME PARAMETERS...
+run_mode() {
+    name=$1
+    shift
+
+    echo "# mode: $name ($*)"
+    if ! insmod "$module" emulate=1 "$@"; then
+        echo "not ok - $name: loading the module failed"
+        return 1
+    fi
+    # let the initial sample settle
+    sleep 1
+
+    output=$("$harness" -n "$readers" -t "$seconds" -d "$debugfs" \
+        "$supply/uevent" \
+        "$supply/capacity" \
+        "$supply/status" \
+        "$supply/energy_now" \
+        "$supply/voltage_now" \
+        "$supply/current_now" \
+        "$supply/time_to_empty_now")
+    ret=$?
+    echo "$output" | sed "s/^/$name /"
+
+    rmmod battery_module
+    if [ $ret -ne 0 ]; then
+        echo "not ok - $name"
+        return 1
+    fi
+    echo "ok - $name"
+    return 0
+}
+
+result=$KSFT_PASS
+run_mode per-register burst_reads=0 combined_reads=0 cache_ttl_ms=0 \
+    i2c_budget=0 || result=$KSFT_FAIL
+run_mode burst burst_reads=1 cache_ttl_ms=0 i2c_budget=0 || result=$KSFT_FAIL
+run_mode cached burst_reads=1 cache_ttl_ms=1000 || result=$KSFT_FAIL
+
+exit $result